@@ -34,7 +34,64 @@
 
 #include <SPIFlash.h>
 
-uint8_t SPIFlash::UNIQUEID[8];
+#ifdef SPIFLASH_ENABLE_STATS
+  #define SPIFLASH_STAT(statement) statement
+#else
+  #define SPIFLASH_STAT(statement)
+#endif
+
+/// CRC-32 (IEEE 802.3, as zlib), see crc32()
+/// ESP32 has it in ROM; elsewhere a 16 entry table does it a nibble at a time, 64 bytes of flash instead of 1K
+#if defined(ARDUINO_ARCH_ESP32) && __has_include(<esp_rom_crc.h>)
+  #include <esp_rom_crc.h>
+  #define SPIFLASH_ROMCRC32(crc, buf, len) esp_rom_crc32_le(crc, buf, len)
+#elif defined(ARDUINO_ARCH_ESP32) && __has_include(<rom/crc.h>)
+  #include <rom/crc.h>
+  #define SPIFLASH_ROMCRC32(crc, buf, len) crc32_le(crc, buf, len)
+#else
+  #ifdef __AVR__
+    #define SPIFLASH_CRCTABLE_ATTR PROGMEM
+    #define SPIFLASH_CRCTABLE(i) pgm_read_dword(&crc32Nibble[i])
+  #else
+    #define SPIFLASH_CRCTABLE_ATTR
+    #define SPIFLASH_CRCTABLE(i) crc32Nibble[i]
+  #endif
+static const uint32_t crc32Nibble[16] SPIFLASH_CRCTABLE_ATTR = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+#endif
+
+#ifdef SPIFLASH_RTOS
+/// holds the device mutex for the rest of the calling scope, public calls nest freely (recursive mutex)
+class SPIFlashGuard {
+public:
+  SPIFlashGuard(SPIFlash& flash) : _flash(flash) { _flash.lock(); }
+  ~SPIFlashGuard() { _flash.unlock(); }
+private:
+  SPIFlash& _flash;
+};
+  #define SPIFLASH_LOCK() SPIFlashGuard _guard(*this)
+
+/// bus lock of a SPIClass, created on first use and then shared by every instance on that bus
+static SemaphoreHandle_t busLockFor(SPIClass* spi) {
+  static struct { SPIClass* spi; SemaphoreHandle_t lock; } buses[SPIFLASH_RTOS_BUSES];
+  if (!spi) return NULL;
+  vTaskSuspendAll();  // instances may be constructed from several tasks
+  uint8_t i = 0;
+  while (i < SPIFLASH_RTOS_BUSES - 1 && buses[i].spi && buses[i].spi != spi) i++;
+  if (!buses[i].spi) {
+    buses[i].spi = spi;
+    buses[i].lock = xSemaphoreCreateBinary();
+    xSemaphoreGive(buses[i].lock);
+  }
+  SemaphoreHandle_t lock = buses[i].lock;
+  xTaskResumeAll();
+  return lock;
+}
+#else
+  #define SPIFLASH_LOCK()
+#endif
 
 /// IMPORTANT: NAND FLASH memory requires erase before write, because
 ///            it can only transition from 1s to 0s and only the erase command can reset all 0s to 1s
@@ -43,8 +100,8 @@ uint8_t SPIFlash::UNIQUEID[8];
 
 /// IMPORTANT: When flash chip is powered down, aka sleeping, the only command it will respond to is 
 ///            Release Power-down / Device ID (ABh), per section 8.2.19 of the W25X40CL datasheet.
-///            This means after using the sleep() function of this library, wake() must be the first
-///            function called. If other commands are used, the flash chip will ignore the commands. 
+///            SPIFlash keeps track of it: after sleep() (or setAutoSleep()) the next command first
+///            sends ABh and waits tRES1, so an explicit wakeup() is no longer needed.
 
 /// Constructor. JedecID is optional but recommended, since this will ensure that the device is present and has a valid response
 /// get this from the datasheet of your flash chip
@@ -55,33 +112,172 @@ SPIFlash::SPIFlash(uint8_t slaveSelectPin, SPIClass *spi, SPISettings settings,
   _jedecID = jedecID;
   _spi = spi;
   _settings = settings;
+  _bus = NULL;
+  _busHeld = false;
+#if defined(__AVR__)
+  _csPort = portOutputRegister(digitalPinToPort(slaveSelectPin));
+  _csMask = digitalPinToBitMask(slaveSelectPin);
+#endif
+  _asyncActive = false;
+  _opHead = _opCount = _opLastToken = 0;
+  _info.jedecID = 0;
+  _info.capacity = 0;
+  _info.pageSize = 256;
+  _info.addressBytes = 3;
+  _info.readModes = 0;
+  _info.readOpcode[0] = 0x3B; _info.readDummy[0] = 8;  // 1-1-2
+  _info.readOpcode[1] = 0xBB; _info.readDummy[1] = 4;  // 1-2-2
+  _info.readOpcode[2] = 0x6B; _info.readDummy[2] = 8;  // 1-1-4
+  _info.readOpcode[3] = 0xEB; _info.readDummy[3] = 6;  // 1-4-4
+  _info.quadEnable = 1;
+  _info.eraseSizeLog2[0] = 12; _info.eraseOpcode[0] = SPIFLASH_BLOCKERASE_4K;
+  _info.eraseSizeLog2[1] = 15; _info.eraseOpcode[1] = SPIFLASH_BLOCKERASE_32K;
+  _info.eraseSizeLog2[2] = 16; _info.eraseOpcode[2] = SPIFLASH_BLOCKERASE_64K;
+  _info.eraseSizeLog2[3] = 0;  _info.eraseOpcode[3] = 0;
+  _info.suspendOpcode = _info.resumeOpcode = 0;
+  _info.suspendLatencyUs = SPIFLASH_TSUS_US;
+  _info.resumeIntervalUs = SPIFLASH_TRS_US;
+  _info.wakeLatencyUs = SPIFLASH_TRES1_US;
+  _info.sfdp = false;
+  _uniqueIdValid = false;
+  _addr4Opcodes = false;
+  _multiIO = NULL;
+  _readMode = 0;
+  _quadProgram = false;
+  _timing.pageProgramUs = SPIFLASH_TPP_US;
+  _timing.statusWriteMs = SPIFLASH_TW_MS;
+  _timing.erase4KMs = SPIFLASH_TSE_MS;
+  _timing.erase32KMs = SPIFLASH_TBE32_MS;
+  _timing.erase64KMs = SPIFLASH_TBE64_MS;
+  _timing.chipEraseMs = SPIFLASH_TCE_MS;
+  _timing.maxMultiplier = SPIFLASH_TMAX_MULTIPLIER;
+  _waitCmd = 0;
+  _continuousPolling = false;
+  _waitAddr = 0;
+  _readSuspend = true;
+  _programSuspend = true;
+  _suspendedCmd = 0;
+  _resumeTime = 0;
+  _lastError = SPIFLASH_ERR_NONE;
+  _wcache = NULL;
+  _wcacheCount = 0;
+  _wcacheTick = 0;
+  _rcache = NULL;
+  _rcacheCount = 0;
+  _rcacheTick = 0;
+  _rcacheNext = SPIFLASH_NOPAGE;
+  _updateScratch = SPIFLASH_NOPAGE;
+  _asleep = true;  // unknown after an MCU reset, the first command wakes it to be safe
+  _autoSleepMs = 0;
+  SPIFLASH_STAT(resetStats());
+  SPIFLASH_STAT(_sleepStart = millis());
+#ifdef SPIFLASH_RTOS
+  _mutex = xSemaphoreCreateRecursiveMutex();
+  _worker = NULL;
+  _workerStop = false;
+  _workerDone = xSemaphoreCreateBinary();
+  _busLock = busLockFor(spi);
+#endif
+}
+
+/// Constructor for a chip behind a custom transport (see SPIFlashBus), ie. the host simulator in extras/host
+SPIFlash::SPIFlash(SPIFlashBus* bus, uint16_t jedecID) : SPIFlash(0xFF, NULL, SPISettings(), jedecID) {
+  _bus = bus;
 }
 
 /// Select the flash chip
+/// an async transfer still owns the bus and the chip select, so it has to finish first
 void SPIFlash::select() {
-  _spi->beginTransaction(_settings);
-  digitalWrite(_slaveSelectPin, LOW);
+  if (_asyncActive) while (!asyncDone());
+  if (_asleep) powerUp();
+  SPIFLASH_STAT(uint32_t t = micros());
+  if (_bus) _bus->select();
+  else {
+    if (!_busHeld) {
+#ifdef SPIFLASH_RTOS
+      xSemaphoreTake(_busLock, portMAX_DELAY);
+#endif
+      _spi->beginTransaction(_settings);
+    }
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();  // the port may be shared with pins written from interrupts
+    *_csPort &= ~_csMask;
+    SREG = sreg;
+#else
+    digitalWrite(_slaveSelectPin, LOW);
+#endif
+  }
+  SPIFLASH_STAT(_selectUs = micros() - t);
 }
 
 /// UNselect the flash chip
 void SPIFlash::unselect() {
-  digitalWrite(_slaveSelectPin, HIGH);
-_spi->endTransaction();
+  SPIFLASH_STAT(uint32_t t = micros());
+  if (_bus) _bus->unselect();
+  else {
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+    *_csPort |= _csMask;
+    SREG = sreg;
+#else
+    digitalWrite(_slaveSelectPin, HIGH);
+#endif
+    if (!_busHeld) {
+      _spi->endTransaction();
+#ifdef SPIFLASH_RTOS
+      xSemaphoreGive(_busLock);
+#endif
+    }
+  }
+  if (_autoSleepMs) _lastUse = millis();
+#ifdef SPIFLASH_ENABLE_STATS
+  t = micros() - t + _selectUs;
+  _selectUs = 0;
+  _stats.transactions++;
+  _stats.transactionUs += t;
+  if (t > _stats.transactionMaxUs) _stats.transactionMaxUs = t;
+#endif
+}
+
+/// begin the SPI transaction once for a run of commands, select()/unselect() then only toggle chip select
+void SPIFlash::holdBus() {
+#ifdef SPIFLASH_RTOS
+  xSemaphoreTake(_busLock, portMAX_DELAY);
+#endif
+  _spi->beginTransaction(_settings);
+  _busHeld = true;
+}
+
+void SPIFlash::releaseBus() {
+  _busHeld = false;
+  _spi->endTransaction();
+#ifdef SPIFLASH_RTOS
+  xSemaphoreGive(_busLock);
+#endif
 }
 
 /// setup SPI, read device ID etc...
 bool SPIFlash::initialize() {
+  SPIFLASH_LOCK();
 
-  pinMode(_slaveSelectPin, OUTPUT);
-  _spi->begin();
+  if (_bus) _bus->begin();
+  else {
+    pinMode(_slaveSelectPin, OUTPUT);
+    digitalWrite(_slaveSelectPin, HIGH);  // deselected, without ending a transaction that was never begun
+    _spi->begin();
+  }
 
-  unselect();
   wakeup();
   
   if (_jedecID == 0 || readDeviceId() == _jedecID) {
-    command(SPIFLASH_STATUSWRITE, true); // Write Status Register
-    _spi->transfer(0);                     // Global Unprotect
+    if (!command(SPIFLASH_STATUSWRITE, true)) return false; // Write Status Register
+    transfer(0);                     // Global Unprotect
     unselect();
+    readChipInfo();
+    _uniqueIdValid = false;
+    readUniqueId();
     return true;
   }
   return false;
@@ -89,15 +285,237 @@ bool SPIFlash::initialize() {
 
 /// Get the manufacturer and device ID bytes (as a short word)
 uint16_t SPIFlash::readDeviceId() {
+  SPIFLASH_LOCK();
   select();
-  _spi->transfer(SPIFLASH_IDREAD);
-  uint16_t jedecid = _spi->transfer(0) << 8;
-  jedecid |= _spi->transfer(0);
+  transfer(SPIFLASH_IDREAD);
+  uint16_t jedecid = transfer(0) << 8;
+  jedecid |= transfer(0);
+  unselect();
+  return jedecid;
+}
+
+/// Get all 3 JEDEC ID bytes: manufacturer, memory type, capacity (ie. 0xEF3013 for the W25X40CL)
+uint32_t SPIFlash::readJedecId() {
+  SPIFLASH_LOCK();
+  if (!command(SPIFLASH_IDREAD)) return 0;
+  uint32_t jedecid = (uint32_t) transfer(0) << 16;
+  jedecid |= (uint16_t) transfer(0) << 8;
+  jedecid |= transfer(0);
   unselect();
   return jedecid;
 }
 
-/// Get the 64 bit unique identifier, stores it in UNIQUEID[8]. Only needs to be called once, ie after initialize
+/// read raw bytes from the SFDP address space
+void SPIFlash::readSFDP(uint32_t addr, void* buf, uint16_t len) {
+  SPIFLASH_LOCK();
+  if (!command(SPIFLASH_SFDPREAD)) {
+    memset(buf, 0xFF, len);  // reads as no SFDP
+    return;
+  }
+  transfer(addr >> 16);
+  transfer(addr >> 8);
+  transfer(addr);
+  transfer(0); //"dont care"
+  readPayload(buf, len);
+  unselect();
+}
+
+/// Fill the chip descriptor (chipInfo()) and the program/erase timing from the JEDEC ID and the
+/// SFDP Basic Flash Parameter Table (JESD216). Called by initialize().
+/// Returns false if the chip has no SFDP table, the descriptor then keeps the classic defaults
+/// and the capacity is derived from the JEDEC capacity byte where the vendor coding is known.
+bool SPIFlash::readChipInfo() {
+  SPIFLASH_LOCK();
+  _info.jedecID = readJedecId();
+  uint8_t density = _info.jedecID;
+  if (density >= 0x10 && density <= 0x19) _info.capacity = 1UL << density;            // Winbond, Macronix, GigaDevice, ...
+  else if (density >= 0x20 && density <= 0x21) _info.capacity = 1UL << (density - 6); // Micron 512Mbit/1Gbit
+  if (_info.capacity > 0x1000000UL) {  // every such part of the vendors above has the 4-byte instruction set
+    _info.addressBytes = 4;
+    _addr4Opcodes = true;
+  }
+  if ((_info.jedecID >> 16) == 0xEF) {  // every Winbond W25Q/W25X part suspends erases with 75h/7Ah
+    _info.suspendOpcode = SPIFLASH_ERASESUSPEND;
+    _info.resumeOpcode = SPIFLASH_ERASERESUME;
+  }
+
+  uint8_t header[8];
+  readSFDP(0, header, 8);
+  if (header[0] != 'S' || header[1] != 'F' || header[2] != 'D' || header[3] != 'P') return false;
+
+  // find the Basic Flash Parameter Table (ID 0xFF00) among the parameter headers
+  uint8_t param[8];
+  uint8_t paramCount = header[6] + 1;
+  uint32_t bfptAddr = 0;
+  uint8_t bfptLen = 0;
+  bool has4BAIT = false;  // 4-byte Address Instruction Table (ID 0xFF84)
+  for (uint8_t i = 0; i < paramCount; i++) {
+    readSFDP(8 + i*8UL, param, 8);
+    if (param[0] == 0x00 && param[7] == 0xFF && !bfptLen) {
+      bfptLen = param[3];
+      bfptAddr = param[4] | ((uint32_t) param[5] << 8) | ((uint32_t) param[6] << 16);
+    }
+    if (param[0] == 0x84 && param[7] == 0xFF) has4BAIT = true;
+  }
+  if (bfptLen < 9) return false;
+  if (bfptLen > 16) bfptLen = 16;
+
+  uint32_t dw[16];
+  memset(dw, 0, sizeof(dw));
+  readSFDP(bfptAddr, dw, bfptLen * 4);
+  for (uint8_t i = 0; i < bfptLen; i++) { // SFDP is little endian
+    uint8_t* b = (uint8_t*) &dw[i];
+    dw[i] = b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+  }
+
+  // DW1: address bytes and fast read modes
+  _info.addressBytes = ((dw[0] >> 17) & 3) == 2 ? 4 : 3;
+  _info.readModes = 0;
+  if (dw[0] & (1UL << 16)) _info.readModes |= SPIFLASH_READ_112;
+  if (dw[0] & (1UL << 20)) _info.readModes |= SPIFLASH_READ_122;
+  if (dw[0] & (1UL << 21)) _info.readModes |= SPIFLASH_READ_144;
+  if (dw[0] & (1UL << 22)) _info.readModes |= SPIFLASH_READ_114;
+
+  // DW3-4: opcode, dummy and mode clocks of each fast read mode
+  static const uint8_t readModeField[SPIFLASH_READMODES] = { 3*2+0, 3*2+1, 2*2+1, 2*2+0 }; // DW(n)*2 + upper half
+  for (uint8_t i = 0; i < SPIFLASH_READMODES; i++) {
+    uint16_t field = dw[readModeField[i]/2] >> (16 * (readModeField[i]%2));
+    if (!(_info.readModes & (1 << i))) continue;
+    _info.readOpcode[i] = field >> 8;
+    _info.readDummy[i] = (field & 0x1F) + ((field >> 5) & 7);
+  }
+
+  // DW2: density in bits, either N+1 or 2^N
+  if (dw[1] & 0x80000000UL) {
+    uint8_t n = dw[1] & 0x7FFFFFFFUL;
+    _info.capacity = n < 3 || n >= 35 ? 0 : 1UL << (n - 3); // under a byte is bogus, beyond 32 bit addresses out of reach
+  }
+  else _info.capacity = (dw[1] >> 3) + 1;
+
+  // DW16: how to get into 4-byte addressing when the chip is larger than 16MB (or 4-byte only)
+  _addr4Opcodes = false;
+  if (_info.capacity > 0x1000000UL) _info.addressBytes = 4;
+  if (_info.addressBytes == 4) {
+    uint8_t enter4 = bfptLen >= 16 ? dw[15] >> 24 : 0;
+    if (has4BAIT || (enter4 & 0x20)) _addr4Opcodes = true;         // dedicated 4-byte instruction set
+    else if ((enter4 & 0x40) || ((dw[0] >> 17) & 3) == 2) ;        // permanently in 4-byte mode
+    else if (enter4 & 0x03) {                                      // B7h, bit 1 when it needs WREN first
+      if (!(enter4 & 0x01) && command(SPIFLASH_WRITEENABLE)) unselect();
+      if (command(SPIFLASH_ENTER4BYTE)) unselect();
+    }
+    else _addr4Opcodes = true;  // only register based methods (or no DW16): the 4-byte opcodes need no mode
+  }
+
+  // DW8-9: erase types, DW10: typical erase times (count+1 units)
+  static const uint16_t eraseUnitMs[4] = { 1, 16, 128, 1000 };
+  uint8_t maxMultiplier = 2 * ((dw[9] & 0xF) + 1);
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++) {
+    uint16_t type = dw[7 + i/2] >> (16 * (i%2));
+    _info.eraseSizeLog2[i] = type;
+    _info.eraseOpcode[i] = _info.eraseSizeLog2[i] ? type >> 8 : 0;
+    if (!_info.eraseSizeLog2[i] || bfptLen < 10) continue;
+    uint16_t field = dw[9] >> (4 + 7*i);
+    uint16_t ms = ((field & 0x1F) + 1) * eraseUnitMs[(field >> 5) & 3];
+    if (_info.eraseSizeLog2[i] == 12) _timing.erase4KMs = ms;
+    else if (_info.eraseSizeLog2[i] == 15) _timing.erase32KMs = ms;
+    else if (_info.eraseSizeLog2[i] == 16) _timing.erase64KMs = ms;
+  }
+
+  // DW11: page size, typical page program and chip erase times
+  if (bfptLen >= 11) {
+    static const uint16_t chipEraseUnitMs[4] = { 16, 256, 4000, 64000 };
+    _info.pageSize = 1 << ((dw[10] >> 4) & 0xF);
+    _timing.pageProgramUs = (((dw[10] >> 8) & 0x1F) + 1) * ((dw[10] & (1UL << 13)) ? 64 : 8);
+    _timing.chipEraseMs = (((dw[10] >> 24) & 0x1F) + 1) * (uint32_t) chipEraseUnitMs[(dw[10] >> 29) & 3];
+    if (2 * ((dw[10] & 0xF) + 1) > maxMultiplier) maxMultiplier = 2 * ((dw[10] & 0xF) + 1);
+  }
+  if (bfptLen >= 10) _timing.maxMultiplier = maxMultiplier;
+
+  // DW12-13: erase suspend/resume, DW12 bit 31 is 0 when supported
+  static const uint16_t delayUnitNs[4] = { 128, 1000, 8000, 64000 };
+  if (bfptLen >= 13) {
+    _info.suspendOpcode = _info.resumeOpcode = 0;
+    if (!(dw[11] & 0x80000000UL)) {
+      _info.suspendOpcode = dw[12] >> 24;  // DW13 from the top: erase suspend, erase resume, program suspend, program resume
+      _info.resumeOpcode = dw[12] >> 16;
+      _info.suspendLatencyUs = ((((dw[11] >> 24) & 0x1F) + 1) * (uint32_t) delayUnitNs[(dw[11] >> 29) & 3] + 999) / 1000;
+      _info.resumeIntervalUs = (((dw[11] >> 20) & 0xF) + 1) * 64;
+    }
+  }
+
+  // DW14: deep power down, bit 31 is 0 when supported, exit delay (count+1 units) in bits 8-14
+  if (bfptLen >= 14 && !(dw[13] & 0x80000000UL))
+    _info.wakeLatencyUs = ((((dw[13] >> 8) & 0x1F) + 1) * (uint32_t) delayUnitNs[(dw[13] >> 13) & 3] + 999) / 1000;
+
+  // DW15: Quad Enable Requirements
+  if (bfptLen >= 15) _info.quadEnable = (dw[14] >> 20) & 7;
+  _info.sfdp = true;
+  return true;
+}
+
+/// attach a board-specific dual/quad transport (NULL detaches it) and pick the fastest read mode that
+/// both the chip (per SFDP) and the wiring support; quadProgram enables 0x32 page programs, only pass
+/// true when the chip's datasheet lists it (SFDP does not describe it)
+/// Returns the selected SPIFLASH_READ_* mode, 0 when readBytes stays on single lane 0x0B
+uint8_t SPIFlash::setMultiIO(SPIFlashMultiIO* io, bool quadProgram) {
+  SPIFLASH_LOCK();
+  _multiIO = io;
+  _readMode = 0;
+  _quadProgram = false;
+  if (!io) return 0;
+  static const uint8_t preference[SPIFLASH_READMODES] = { SPIFLASH_READ_144, SPIFLASH_READ_114, SPIFLASH_READ_122, SPIFLASH_READ_112 };
+  for (uint8_t i = 0; i < SPIFLASH_READMODES && !_readMode; i++) {
+    uint8_t mode = preference[i];
+    if (!(_info.readModes & mode)) continue;
+    if ((mode & (SPIFLASH_READ_144 | SPIFLASH_READ_114)) && (io->lanes() < 4 || !enableQuad())) continue;
+    _readMode = mode;
+  }
+  _quadProgram = quadProgram && io->lanes() >= 4 && enableQuad();
+  return _readMode;
+}
+
+/// set the Quad Enable bit as described by the SFDP QER field, returns false if it cannot be done
+bool SPIFlash::enableQuad() {
+  uint8_t sr1 = readStatus();
+  uint8_t sr2;
+  switch (_info.quadEnable) {
+    case 0:  // no QE bit, quad modes always available
+      return true;
+    case 2:  // QE is bit 6 of status register 1
+      if (sr1 & 0x40) return true;
+      if (!command(SPIFLASH_STATUSWRITE, true)) return false;
+      transfer(sr1 | 0x40);
+      unselect();
+      return true;
+    case 1:  // QE is bit 1 of status register 2, written together with status register 1
+    case 4:
+    case 5:
+    case 6:  // same bit, with its own write command
+      if (!command(SPIFLASH_STATUS2READ)) return false;
+      sr2 = transfer(0);
+      unselect();
+      if (sr2 & 0x02) return true;
+      if (_info.quadEnable == 6) {
+        if (!command(SPIFLASH_STATUS2WRITE, true)) return false;
+      }
+      else {
+        if (!command(SPIFLASH_STATUSWRITE, true)) return false;
+        transfer(sr1);
+      }
+      transfer(sr2 | 0x02);
+      unselect();
+      return true;
+  }
+  return false;
+}
+
+/// chip descriptor, valid after initialize()
+const SPIFlashInfo& SPIFlash::chipInfo() {
+  return _info;
+}
+
+/// Get the 64 bit unique identifier, stores it in UNIQUEID[8]. initialize() reads it, later calls return the
+/// cached copy without touching the bus
 /// Returns the byte pointer to the UNIQUEID byte array
 /// Read UNIQUEID like this:
 /// flash.readUniqueId(); for (uint8_t i=0;i<8;i++) { Serial.print(flash.UNIQUEID[i], HEX); Serial.print(' '); }
@@ -105,62 +523,510 @@ uint16_t SPIFlash::readDeviceId() {
 /// flash.readUniqueId(); uint8_t* MAC = flash.readUniqueId(); for (uint8_t i=0;i<8;i++) { Serial.print(MAC[i], HEX); Serial.print(' '); }
 uint8_t* SPIFlash::readUniqueId()
 {
-  command(SPIFLASH_MACREAD);
-  _spi->transfer(0);
-  _spi->transfer(0);
-  _spi->transfer(0);
-  _spi->transfer(0);
+  SPIFLASH_LOCK();
+  if (_uniqueIdValid || !command(SPIFLASH_MACREAD)) return UNIQUEID;
+  if (_info.addressBytes == 4 && !_addr4Opcodes) transfer(0);  // one more dummy byte in 4-byte address mode
+  transfer(0);
+  transfer(0);
+  transfer(0);
+  transfer(0);
   for (uint8_t i=0;i<8;i++)
-    UNIQUEID[i] = _spi->transfer(0);
+    UNIQUEID[i] = transfer(0);
   unselect();
+  _uniqueIdValid = true;
   return UNIQUEID;
 }
 
 /// read 1 byte from flash memory
 uint8_t SPIFlash::readByte(uint32_t addr) {
-  command(SPIFLASH_ARRAYREADLOWFREQ);
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
-  uint8_t result = _spi->transfer(0);
-  unselect();
+  SPIFLASH_LOCK();
+  if (!inRange(addr, 1)) return 0xFF;
+  if (_rcache) {
+    uint8_t result;
+    cacheRead(addr, &result, 1);
+    return result;
+  }
+  if (_wcache) flushRange(addr, 1);
+  bool suspended = suspendErase();
+  uint8_t result = 0xFF;
+  if (command(SPIFLASH_ARRAYREADLOWFREQ)) {
+    sendAddress(addr);
+    result = transfer(0);
+    unselect();
+  }
+  SPIFLASH_STAT(_stats.bytesRead++);
+  if (suspended) resumeErase();
   return result;
 }
 
-/// read unlimited # of bytes
-void SPIFlash::readBytes(uint32_t addr, void* buf, uint16_t len) {
-  command(SPIFLASH_ARRAYREAD);
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
-  _spi->transfer(0); //"dont care"
+/// read unlimited # of bytes (len is 32 bit, a whole image can be read into external RAM in one go)
+/// The single lane path reads it as one continuous fast read, the multi-lane transport gets it in SPIFLASH_READCHUNK pieces
+void SPIFlash::readBytes(uint32_t addr, void* buf, uint32_t len) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return;
+  if (_rcache && len <= _rcacheLineSize) {
+    cacheRead(addr, (uint8_t*) buf, len);
+    return;
+  }
+  readArray(addr, buf, len);
+}
+
+/// readBytes() past the read cache, for data this instance programs behind the cache's back (update() journal)
+/// Returns false, with buf set to 0xFF, if the chip timed out
+bool SPIFlash::readArray(uint32_t addr, void* buf, uint32_t len) {
+  if (_wcache) flushRange(addr, len);
+  bool suspended = suspendErase();
+  bool ok = _readMode ? waitReady() : command(SPIFLASH_ARRAYREAD);
+  if (!ok) memset(buf, 0xFF, len);
+  else if (_readMode) {
+    uint8_t mode = 0;
+    while (!(_readMode & (1 << mode))) mode++;
+    uint8_t opcode = _info.readOpcode[mode];
+    if (_addr4Opcodes) opcode++;  // 0x3C, 0xBC, 0x6C, 0xEC
+    uint8_t* out = (uint8_t*) buf;
+    while (len) {
+      uint16_t n = len < SPIFLASH_READCHUNK ? len : SPIFLASH_READCHUNK;
+      _multiIO->read(opcode, addr, _info.addressBytes, (_readMode & SPIFLASH_READ_144) ? 4 : (_readMode & SPIFLASH_READ_122) ? 2 : 1,
+                     _info.readDummy[mode], (_readMode & (SPIFLASH_READ_144 | SPIFLASH_READ_114)) ? 4 : 2, out, n);
+      SPIFLASH_STAT(_stats.bytesRead += n);
+      addr += n;
+      out += n;
+      len -= n;
+    }
+  }
+  else {
+    sendAddress(addr);
+    transfer(0); //"dont care"
+    uint8_t* out = (uint8_t*) buf;
+    while (len) {
+      uint16_t n = len < SPIFLASH_READCHUNK ? len : SPIFLASH_READCHUNK;
+      readPayload(out, n);
+      out += n;
+      len -= n;
+    }
+    unselect();
+  }
+  if (suspended) resumeErase();
+  return ok;
+}
+
+/// enable the read cache: count line descriptors plus count*lineSize bytes of line data, both caller-owned
+/// lineSize must be a power of 2 (ie. 32 or 64); NULL/0 disables the cache
+/// Example: SPIFlashCacheLine lines[4]; uint8_t lineData[4*32]; flash.setReadCache(lines, 4, lineData, 32);
+/// lines are invalidated by writeByte/writeBytes, the erase calls, the queue and async writes of this instance
+void SPIFlash::setReadCache(SPIFlashCacheLine* lines, uint8_t count, uint8_t* data, uint16_t lineSize) {
+  SPIFLASH_LOCK();
+  _rcache = count ? lines : NULL;
+  _rcacheCount = count;
+  _rcacheData = data;
+  _rcacheLineSize = lineSize;
+  _rcacheNext = SPIFLASH_NOPAGE;
+  _rcacheTick = 0;
+  for (uint8_t i = 0; i < _rcacheCount; i++) {
+    _rcache[i].addr = SPIFLASH_NOPAGE;
+    _rcache[i].stamp = 0;
+  }
+}
+
+#ifdef SPIFLASH_ENABLE_STATS
+/// counters and timers since construction or the last resetStats(), see SPIFlashStats
+const SPIFlashStats& SPIFlash::getStats() {
+  return _stats;
+}
+
+void SPIFlash::resetStats() {
+  memset(&_stats, 0, sizeof(_stats));
+  _selectUs = 0;
+}
+#endif
+
+void SPIFlash::cacheRead(uint32_t addr, uint8_t* buf, uint16_t len) {
+  while (len > 0) {
+    uint32_t lineAddr = addr & ~(uint32_t)(_rcacheLineSize - 1);
+    uint16_t offset = addr - lineAddr;
+    uint16_t n = _rcacheLineSize - offset;
+    if (n > len) n = len;
+
+    SPIFlashCacheLine* line = NULL;
+    for (uint8_t i = 0; i < _rcacheCount && !line; i++)
+      if (_rcache[i].addr == lineAddr) line = &_rcache[i];
+    if (!line) line = fillLine(lineAddr);
+    line->stamp = ++_rcacheTick;
+    memcpy(buf, _rcacheData + (uint16_t)(line - _rcache) * _rcacheLineSize + offset, n);
+
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+/// fetch a line (and the next one too when the access pattern is sequential and it is not cached yet)
+/// into empty slots first, then the least recently used ones
+SPIFlashCacheLine* SPIFlash::fillLine(uint32_t lineAddr) {
+  uint8_t lines = (lineAddr == _rcacheNext && _rcacheCount > 1) ? 2 : 1;
+  for (uint8_t i = 0; i < _rcacheCount && lines > 1; i++)
+    if (_rcache[i].addr == lineAddr + _rcacheLineSize) lines = 1;
+  if (_wcache) flushRange(lineAddr, (uint32_t) lines * _rcacheLineSize);
+  bool suspended = suspendErase();
+  if (!command(SPIFLASH_ARRAYREAD)) {  // timed out: hand back an uncached line of 0xFF
+    if (suspended) resumeErase();
+    memset(_rcacheData, 0xFF, _rcacheLineSize);
+    _rcache[0].addr = SPIFLASH_NOPAGE;
+    return &_rcache[0];
+  }
+  sendAddress(lineAddr);
+  transfer(0); //"dont care"
+  SPIFlashCacheLine* first = NULL;
+  for (uint8_t l = 0; l < lines; l++) {
+    SPIFlashCacheLine* victim = &_rcache[0];
+    for (uint8_t i = 1; i < _rcacheCount && victim->addr != SPIFLASH_NOPAGE; i++)
+      if (_rcache[i].addr == SPIFLASH_NOPAGE || (uint16_t)(_rcacheTick - _rcache[i].stamp) > (uint16_t)(_rcacheTick - victim->stamp)) victim = &_rcache[i];
+    readPayload(_rcacheData + (uint16_t)(victim - _rcache) * _rcacheLineSize, _rcacheLineSize);
+    victim->addr = lineAddr;
+    victim->stamp = ++_rcacheTick;
+    if (!first) first = victim;
+    lineAddr += _rcacheLineSize;
+  }
+  unselect();
+  if (suspended) resumeErase();
+  _rcacheNext = lineAddr;
+  return first;
+}
+
+/// drop cached lines overlapping a range that is about to be programmed or erased
+void SPIFlash::invalidateLines(uint32_t addr, uint32_t len) {
+  for (uint8_t i = 0; i < _rcacheCount; i++)
+    if (_rcache[i].addr != SPIFLASH_NOPAGE && _rcache[i].addr + _rcacheLineSize > addr && _rcache[i].addr < addr + len)
+      _rcache[i].addr = SPIFLASH_NOPAGE;
+}
+
+/// clock in the data phase of a read, chip must already be selected and addressed
+/// the flash ignores MOSI here, so the in-place buffer transfer can send whatever is in buf
+void SPIFlash::readPayload(void* buf, uint16_t len) {
+  SPIFLASH_STAT(_stats.bytesRead += len);
+  if (_bus) {
+    _bus->read(buf, len);
+    return;
+  }
+#ifdef SPIFLASH_BYTE_TRANSFER
   for (uint16_t i = 0; i < len; ++i)
-    ((uint8_t*) buf)[i] = _spi->transfer(0);
+    ((uint8_t*) buf)[i] = transfer(0);
+#else
+  _spi->transfer(buf, len);
+#endif
+}
+
+/// clock out the data phase of a page program, chip must already be selected and addressed
+/// buf is const, so cores without a transmit-only call go through a small bounce buffer
+void SPIFlash::writePayload(const void* buf, uint16_t len) {
+  SPIFLASH_STAT(_stats.bytesWritten += len);
+  if (_bus) {
+    _bus->write(buf, len);
+    return;
+  }
+#if defined(SPIFLASH_HAS_WRITEBYTES)
+  _spi->writeBytes((const uint8_t*) buf, len);
+#elif defined(SPIFLASH_HAS_TRANSMITONLY)
+  _spi->transfer((void*) buf, len, SPI_TRANSMITONLY);
+#elif defined(SPIFLASH_BYTE_TRANSFER)
+  for (uint16_t i = 0; i < len; i++)
+    transfer(((const uint8_t*) buf)[i]);
+#else
+  uint8_t chunk[SPIFLASH_TXCHUNK];
+  while (len > 0) {
+    uint8_t n = (len < SPIFLASH_TXCHUNK) ? len : SPIFLASH_TXCHUNK;
+    memcpy(chunk, buf, n);
+    _spi->transfer(chunk, n);
+    buf = (const uint8_t*) buf + n;
+    len -= n;
+  }
+#endif
+}
+
+/// start reading len bytes into buf and return while the data phase runs (DMA where available)
+/// buf must stay valid until asyncDone() returns true, the callback then runs from asyncDone()
+/// Returns false if another async transfer is still in flight
+/// Without DMA support the read completes (and the callback runs) before this returns
+bool SPIFlash::readBytesAsync(uint32_t addr, void* buf, uint16_t len, SPIFlashCallback callback, void* context) {
+  SPIFLASH_LOCK();
+  if (_asyncActive || !inRange(addr, len)) return false;
+  if (_wcache) flushRange(addr, len);
+  if (!command(SPIFLASH_ARRAYREAD)) return false;
+  sendAddress(addr);
+  transfer(0); //"dont care"
+  _asyncCallback = callback;
+  _asyncContext = context;
+  _asyncActive = true;
+#ifdef SPIFLASH_USE_DMA
+  if (!_bus) {
+    SPIFLASH_STAT(_stats.bytesRead += len);
+    _spi->transfer(NULL, buf, len, false);
+    return true;
+  }
+#endif
+  readPayload(buf, len);
+  asyncDone();
+  return true;
+}
+
+/// start programming up to one page and return while the data phase runs (DMA where available)
+/// the range must not cross a page boundary, buf must stay valid until asyncDone() returns true
+/// Returns false if the range crosses a page or another async transfer is still in flight
+/// WARNING: you can only write to previously erased memory locations (see datasheet)
+bool SPIFlash::writePageAsync(uint32_t addr, const void* buf, uint16_t len, SPIFlashCallback callback, void* context) {
+  SPIFLASH_LOCK();
+  if (_asyncActive || len == 0 || (addr%_info.pageSize) + len > _info.pageSize || !inRange(addr, len)) return false;
+  if (_rcache) invalidateLines(addr, len);
+  if (!command(SPIFLASH_BYTEPAGEPROGRAM, true)) return false;  // Byte/Page Program
+  sendAddress(addr);
+  _asyncCallback = callback;
+  _asyncContext = context;
+  _asyncActive = true;
+#ifdef SPIFLASH_USE_DMA
+  if (!_bus) {
+    SPIFLASH_STAT(_stats.bytesWritten += len);
+    _spi->transfer(buf, NULL, len, false);
+    return true;
+  }
+#endif
+  writePayload(buf, len);
+  asyncDone();
+  return true;
+}
+
+/// poll the pending async transfer, returns true when nothing is in flight
+/// on completion this releases the chip select and the bus, then runs the callback
+bool SPIFlash::asyncDone() {
+  SPIFLASH_LOCK();
+  if (!_asyncActive) return true;
+#ifdef SPIFLASH_USE_DMA
+  if (!_bus && _spi->isBusy()) return false;
+#endif
+  _asyncActive = false;
   unselect();
+  if (_asyncCallback) _asyncCallback(_asyncContext);
+  return true;
 }
 
 /// Send a command to the flash chip, pass TRUE for isWrite when its a write command
-void SPIFlash::command(uint8_t cmd, bool isWrite) {
+/// On 4-byte address chips with the dedicated instruction set, read/program/erase opcodes are swapped for their 4-byte versions
+/// Returns false, with the chip left deselected, if it was still busy after the hard timeout (lastError() is then
+/// SPIFLASH_ERR_TIMEOUT): skip the rest of the command and the unselect()
+bool SPIFlash::command(uint8_t cmd, bool isWrite) {
 
   if (isWrite) {
-    command(SPIFLASH_WRITEENABLE); // Write Enable
+    if (!command(SPIFLASH_WRITEENABLE)) return false; // Write Enable
     unselect();
   }
   //  wait for any write/erase to complete
-  //  a time limit cannot really be added here without it being a very large safe limit
-  //  that is because some chips can take several seconds to carry out a chip erase or other similar multi block or entire-chip operations
+  //  the time limit comes from the timing of the last write-class command, see waitReady()
   //  
   //  Note: If the MISO line is high, busy() will return true. 
-  //        This can be a problem and cause the code to hang when there is noise/static on MISO data line when:
+  //        This used to hang the code when there is noise/static on MISO data line when:
   //        1) There is no flash chip connected
   //        2) The flash chip connected is powered down, aka sleeping. 
-  if (cmd != SPIFLASH_WAKE) while(busy());
+  //        now waitReady() gives up after the hard timeout and lastError() reports SPIFLASH_ERR_TIMEOUT
+  if (cmd != SPIFLASH_WAKE && !waitReady()) return false;
+  select();
+  if (isWrite) {
+    _waitCmd = cmd;  // remember what the chip is about to be busy with, to pace the next waitReady()
+    _waitStart = micros();
+#ifdef SPIFLASH_ENABLE_STATS
+    switch (eraseSizeLog2(cmd)) {
+      case 12: _stats.erases4K++; break;
+      case 15: _stats.erases32K++; break;
+      case 16: _stats.erases64K++; break;
+    }
+    if (cmd == SPIFLASH_BYTEPAGEPROGRAM) _stats.pagePrograms++;
+    else if (cmd == SPIFLASH_CHIPERASE) _stats.chipErases++;
+#endif
+  }
+  if (_addr4Opcodes) {
+    switch (cmd) {
+      case SPIFLASH_ARRAYREAD:        cmd = SPIFLASH_ARRAYREAD4B; break;
+      case SPIFLASH_ARRAYREADLOWFREQ: cmd = SPIFLASH_ARRAYREADLOWFREQ4B; break;
+      case SPIFLASH_BYTEPAGEPROGRAM:  cmd = SPIFLASH_BYTEPAGEPROGRAM4B; break;
+      case SPIFLASH_BLOCKERASE_4K:    cmd = SPIFLASH_BLOCKERASE_4K4B; break;
+      case SPIFLASH_BLOCKERASE_32K:   cmd = SPIFLASH_BLOCKERASE_32K4B; break;
+      case SPIFLASH_BLOCKERASE_64K:   cmd = SPIFLASH_BLOCKERASE_64K4B; break;
+    }
+  }
+  transfer(cmd);
+  return true;
+}
+
+/// send the 3 or 4 address bytes of a command, per the chip's addressing mode
+void SPIFlash::sendAddress(uint32_t addr) {
+  if (_info.addressBytes == 4) transfer(addr >> 24);
+  transfer(addr >> 16);
+  transfer(addr >> 8);
+  transfer(addr);
+}
+
+/// check a security register range (SPIFLASH_ERR_RANGE when it does not fit), then send cmd and its address
+/// The address is 4 bytes only while the chip itself is in 4-byte address mode, the 4-byte opcodes do not cover these
+bool SPIFlash::securityCommand(uint8_t cmd, uint8_t reg, uint16_t offset, uint16_t len) {
+  if (reg < 1 || reg > SPIFLASH_SECREGCOUNT || offset > SPIFLASH_SECREGSIZE || len > SPIFLASH_SECREGSIZE - offset) {
+    _lastError = SPIFLASH_ERR_RANGE;
+    return false;
+  }
+  uint32_t addr = ((uint32_t) reg << 12) | offset;
+  if (!command(cmd, cmd != SPIFLASH_SECREGREAD)) return false;
+  if (_info.addressBytes == 4 && !_addr4Opcodes) transfer(addr >> 24);
+  transfer(addr >> 16);
+  transfer(addr >> 8);
+  transfer(addr);
+  return true;
+}
+
+/// check an address range against the chip capacity (when known), sets SPIFLASH_ERR_RANGE if it does not fit
+bool SPIFlash::inRange(uint32_t addr, uint32_t len) {
+  if (_info.capacity && (addr >= _info.capacity || len > _info.capacity - addr)) {
+    _lastError = SPIFLASH_ERR_RANGE;
+    return false;
+  }
+  return true;
+}
+
+/// typical and hard timeout duration of a write-class command, in microseconds
+/// erases are looked up by opcode in the chip descriptor, anything unknown or not issued through
+/// command(..., true) (ie. busy after an MCU reset) gets the 64K erase timing
+void SPIFlash::expectedTime(uint8_t cmd, uint32_t& typUs, uint32_t& maxUs) {
+  switch (cmd) {
+    case SPIFLASH_BYTEPAGEPROGRAM: typUs = _timing.pageProgramUs; break;
+    case SPIFLASH_STATUSWRITE:     typUs = _timing.statusWriteMs * 1000UL; break;
+    case SPIFLASH_CHIPERASE:       typUs = _timing.chipEraseMs < 0xFFFFFFFFUL / 1000 ? _timing.chipEraseMs * 1000UL : 0xFFFFFFFFUL; break;
+    case SPIFLASH_SECREGPROGRAM:   typUs = _timing.pageProgramUs; break;
+    case SPIFLASH_SECREGERASE:     typUs = _timing.erase4KMs * 1000UL; break;
+    default: {
+      uint8_t sizeLog2 = eraseSizeLog2(cmd);
+      if (sizeLog2 == 12) typUs = _timing.erase4KMs * 1000UL;
+      else if (sizeLog2 && sizeLog2 <= 15) typUs = _timing.erase32KMs * 1000UL;
+      else typUs = _timing.erase64KMs * 1000UL;
+    }
+  }
+  maxUs = typUs < 0xFFFFFFFFUL / (_timing.maxMultiplier ? _timing.maxMultiplier : 1) ? typUs * _timing.maxMultiplier : 0xFFFFFFFFUL;  // saturate, ie. a 64s chip erase x32
+  if (cmd == 0) typUs = 0;  // nothing known to be in progress, start polling right away
+}
+
+/// wait for the chip to finish the current write/erase without hammering the bus:
+/// first sit out the typical duration (yield()ing to other tasks), then poll the status register
+/// with exponential backoff, or with continuous polling keep CS asserted and clock the status
+/// register repeatedly (the 0x05 command keeps returning it).
+/// Returns false (and sets lastError() to SPIFLASH_ERR_TIMEOUT) if the chip is still busy after the hard timeout
+bool SPIFlash::waitReady() {
+  SPIFLASH_LOCK();
+  SPIFLASH_STAT(uint32_t entered = micros());
+  uint32_t typUs, maxUs;
+  expectedTime(_waitCmd, typUs, maxUs);
+  uint32_t start = _waitCmd ? _waitStart : micros();
+  _waitCmd = 0;
+  bool held = _busHeld && typUs;  // a runBatch() lets go of the bus while the chip is busy
+  if (held) releaseBus();
+  while (micros() - start < typUs) yield();
+
+  bool ready;
+  if (_continuousPolling) {
+    select();
+    transfer(SPIFLASH_STATUSREAD);
+    while (!(ready = !(transfer(0) & 1)) && micros() - start < maxUs) SPIFLASH_STAT(_stats.busyPolls++);
+    unselect();
+  }
+  else {
+    uint32_t interval = typUs / 16;
+    if (interval < SPIFLASH_POLL_MIN_US) interval = SPIFLASH_POLL_MIN_US;
+    if (interval > SPIFLASH_POLL_MAX_US) interval = SPIFLASH_POLL_MAX_US;  // a chip erase would otherwise poll every few 100ms
+    while (!(ready = !busy()) && micros() - start < maxUs) {
+      uint32_t t = micros();
+      while (micros() - t < interval) yield();
+      interval <<= 1;
+      if (interval > SPIFLASH_POLL_MAX_US) interval = SPIFLASH_POLL_MAX_US;
+    }
+  }
+  if (!ready) _lastError = SPIFLASH_ERR_TIMEOUT;
+  if (held) holdBus();
+#ifdef SPIFLASH_ENABLE_STATS
+  uint32_t waited = micros() - entered;
+  _stats.waits++;
+  _stats.waitUs += waited;
+  if (waited > _stats.waitMaxUs) _stats.waitMaxUs = waited;
+#endif
+  return ready;
+}
+
+/// replace the default (W25X40CL class) program/erase timing used by waitReady()
+void SPIFlash::setTiming(const SPIFlashTiming& timing) {
+  _timing = timing;
+}
+
+/// keep CS asserted and stream the status register while waiting, instead of one transaction per poll
+/// fastest reaction to BUSY clearing, but holds the bus for the whole wait
+void SPIFlash::setContinuousPolling(bool enable) {
+  _continuousPolling = enable;
+}
+
+/// suspend a running sector/block erase for the duration of readByte/readBytes (enabled by default)
+/// A read then waits tens of microseconds instead of the rest of the erase. Only used when the chip
+/// supports it (SFDP DW12/13, or a Winbond part), chip erase and page programs are never suspended,
+/// and reads that have to flush dirty write-cache pages first still wait for the erase.
+void SPIFlash::setReadSuspend(bool enable) {
+  _readSuspend = enable;
+}
+
+/// let page programs outside the block being erased suspend a running sector/block erase too (enabled by
+/// default), so writeBytes() waits for the suspend instead of the rest of the erase (ie. SPIFlashLog appends
+/// during its queued erase-ahead). JESD216 chips that suspend erases accept programs to other blocks meanwhile;
+/// programs into the erasing block, and the async and queued writes, still wait for the erase.
+void SPIFlash::setProgramSuspend(bool enable) {
+  _programSuspend = enable;
+}
+
+/// suspend the erase this instance last issued if it is still running, returns true if it did
+/// For a read addr is SPIFLASH_NOPAGE, for a program the range about to be written, which must lie outside
+/// the block being erased. The erase is left running at least resumeIntervalUs after the previous resume
+/// so that back to back reads and programs cannot starve it.
+bool SPIFlash::suspendErase(uint32_t addr, uint32_t len) {
+  bool program = addr != SPIFLASH_NOPAGE;
+  if (!(program ? _programSuspend : _readSuspend) || !_info.suspendOpcode || !_waitCmd) return false;
+  uint8_t sizeLog2 = eraseSizeLog2(_waitCmd);
+  if (!sizeLog2) return false;
+  if (program && _waitAddr < addr + len && addr < _waitAddr + (1UL << sizeLog2)) return false;
+  while (micros() - _resumeTime < _info.resumeIntervalUs) yield();
+  if (!busy()) {
+    _waitCmd = 0;
+    return false;
+  }
+  select();
+  transfer(_info.suspendOpcode);
+  unselect();
+  _suspendStart = micros();
+  _suspendedCmd = _waitCmd;
+  _waitCmd = 0;  // the read waits for the suspend only, not for the rest of the erase
+  while (busy() && micros() - _suspendStart < (uint32_t) _info.suspendLatencyUs * SPIFLASH_TMAX_MULTIPLIER) yield();
+  return true;
+}
+
+/// resume the erase suspended by suspendErase(), its timeout is extended by the time it spent suspended
+void SPIFlash::resumeErase() {
   select();
-  _spi->transfer(cmd);
+  transfer(_info.resumeOpcode);
+  unselect();
+  _resumeTime = micros();
+  _waitCmd = _suspendedCmd;
+  _waitStart += _resumeTime - _suspendStart;
+  _suspendedCmd = 0;
+}
+
+/// last error (SPIFLASH_ERR_*), cleared by reading it
+uint8_t SPIFlash::lastError() {
+  uint8_t err = _lastError;
+  _lastError = SPIFLASH_ERR_NONE;
+  return err;
 }
 
 /// check if the chip is busy erasing/writing
 bool SPIFlash::busy() {
+  SPIFLASH_LOCK();
   /*
   select();
   SPI.transfer(SPIFLASH_STATUSREAD);
@@ -168,14 +1034,16 @@ bool SPIFlash::busy() {
   unselect();
   return status & 1;
   */
+  SPIFLASH_STAT(_stats.busyPolls++);
   return readStatus() & 1;
 }
 
 /// return the STATUS register
 uint8_t SPIFlash::readStatus() {
+  SPIFLASH_LOCK();
   select();
-  _spi->transfer(SPIFLASH_STATUSREAD);
-  uint8_t status = _spi->transfer(0);
+  transfer(SPIFLASH_STATUSREAD);
+  uint8_t status = transfer(0);
   unselect();
   return status;
 }
@@ -185,43 +1053,264 @@ uint8_t SPIFlash::readStatus() {
 /// WARNING: you can only write to previously erased memory locations (see datasheet)
 ///          use the block erase commands to first clear memory (write 0xFFs)
 void SPIFlash::writeByte(uint32_t addr, uint8_t byt) {
-  command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
-  _spi->transfer(byt);
+  SPIFLASH_LOCK();
+  if (!inRange(addr, 1)) return;
+  if (_rcache) invalidateLines(addr, 1);
+  if (_wcache) {
+    cacheWrite(addr, &byt, 1);
+    return;
+  }
+  if (!command(SPIFLASH_BYTEPAGEPROGRAM, true)) return;  // Byte/Page Program
+  sendAddress(addr);
+  transfer(byt);
   unselect();
+  SPIFLASH_STAT(_stats.bytesWritten++);
 }
 
-/// write multiple bytes to flash memory (up to 64K)
+/// write multiple bytes to flash memory (len is 32 bit, one page program loop for a whole image)
 /// WARNING: you can only write to previously erased memory locations (see datasheet)
 ///          use the block erase commands to first clear memory (write 0xFFs)
 /// This version handles both page alignment and data blocks larger than 256 bytes.
 ///
-void SPIFlash::writeBytes(uint32_t addr, const void* buf, uint16_t len) {
-  uint16_t n;
-  uint16_t maxBytes = 256-(addr%256);  // force the first set of bytes to stay within the first page
-  uint16_t offset = 0;
-  while (len>0)
+void SPIFlash::writeBytes(uint32_t addr, const void* buf, uint32_t len) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return;
+  if (_rcache) invalidateLines(addr, len);
+  if (_wcache) {
+    cacheWrite(addr, (const uint8_t*) buf, len);
+    return;
+  }
+  programBytes(addr, (const uint8_t*) buf, len);
+}
+
+/// gather write: prefixLen bytes of prefix immediately followed by len bytes of buf, written from addr as if
+/// they were one buffer, so a small header and its payload share page programs without being copied together
+void SPIFlash::writeBytes(uint32_t addr, const void* prefix, uint16_t prefixLen, const void* buf, uint32_t len) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, prefixLen + len)) return;
+  if (_rcache) invalidateLines(addr, prefixLen + len);
+  if (_wcache) {
+    cacheWrite(addr, (const uint8_t*) prefix, prefixLen);
+    cacheWrite(addr + prefixLen, (const uint8_t*) buf, len);
+    return;
+  }
+  programBytes(addr, (const uint8_t*) buf, len, (const uint8_t*) prefix, prefixLen);
+}
+
+/// split a write (prefix first, then buf) into page programs on the chip's page boundaries
+/// A running erase of another block is suspended for it, see setProgramSuspend()
+/// Returns false if the chip timed out, the rest of the write is then dropped
+bool SPIFlash::programBytes(uint32_t addr, const uint8_t* buf, uint32_t len, const uint8_t* prefix, uint16_t prefixLen) {
+  bool suspended = suspendErase(addr, prefixLen + len);
+  bool ok = true;
+  uint32_t n;
+  uint16_t maxBytes = _info.pageSize-(addr%_info.pageSize);  // force the first set of bytes to stay within the first page
+  while (prefixLen + len > 0 && ok)
   {
-    n = (len<=maxBytes) ? len : maxBytes;
-    command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-    _spi->transfer(addr >> 16);
-    _spi->transfer(addr >> 8);
-    _spi->transfer(addr);
-    
-    for (uint16_t i = 0; i < n; i++) {
-      _spi->transfer(((uint8_t*) buf)[offset + i]);
-    }
-    unselect();
-    
+    n = (prefixLen + len <= maxBytes) ? prefixLen + len : maxBytes;
+    uint16_t p = prefixLen < n ? prefixLen : n;
+    ok = programPage(addr, prefix, p, buf, n - p);
     addr+=n;  // adjust the addresses and remaining bytes by what we've just transferred.
-    offset +=n;
+    prefix += p;
+    prefixLen -= p;
+    buf += n - p;
+    len -= n - p;
+    maxBytes = _info.pageSize;   // now we can do up to a full page per loop
+  }
+  if (suspended) {
+    ok = waitReady() && ok;  // the erase resumes only once the last page is programmed
+    resumeErase();
+  }
+  return ok;
+}
+
+/// Pipelined bulk write: len bytes from addr, pulled page by page from source(buf, n, context)
+/// source is called for the next page right after the previous page program (or erase) was issued,
+/// so producing the data (compressing, CRCing, copying from a sensor FIFO) overlaps the chip's tPP
+/// instead of following it. source returns how many bytes it put in buf (up to n), the stream ends
+/// early when it returns less than n. Returns the number of bytes written.
+/// When erase is set, every 4K sector is erased as the stream reaches its first byte (a stream starting
+/// inside a sector does not erase that sector), and source runs during that erase as well.
+uint32_t SPIFlash::writeStream(uint32_t addr, uint32_t len, SPIFlashSource source, void* context, bool erase) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return 0;
+  if (_wcache) flushRange(addr, len);
+  if (_rcache) invalidateLines(addr, len);
+  uint8_t buf[SPIFLASH_STREAMCHUNK];
+  uint32_t done = 0;
+  while (len) {
+    uint16_t n = _info.pageSize - (addr % _info.pageSize);
+    if (n > SPIFLASH_STREAMCHUNK) n = SPIFLASH_STREAMCHUNK;
+    if (n > len) n = len;
+    if (erase && !(addr & 0xFFF)) blockErase4K(addr);
+    uint16_t got = source(buf, n, context);  // the chip is busy with the previous page or the erase meanwhile
+    if (got > n) got = n;
+    if (got && !programPage(addr, buf, got)) break;
+    addr += got;
+    done += got;
+    len -= got;
+    if (got < n) break;
+  }
+  return done;
+}
+
+static uint16_t streamSource(uint8_t* buf, uint16_t len, void* context) {
+  return ((Stream*) context)->readBytes((char*) buf, len);
+}
+
+/// writeStream() fed from an Arduino Stream (ie. Serial or a network client), ends when in times out
+uint32_t SPIFlash::writeStream(uint32_t addr, uint32_t len, Stream& in, bool erase) {
+  return writeStream(addr, len, streamSource, &in, erase);
+}
+
+/// Streaming read: len bytes from addr handed to sink(buf, n, context) SPIFLASH_STREAMCHUNK bytes at a time,
+/// all inside one fast read transaction, so there is neither a command header per chunk nor a buffer of the
+/// full length. Returns the number of bytes handed to sink, less than len when sink ended the stream.
+/// NOTE: the chip stays selected and the SPI bus taken while sink runs; read in chunks with readBytes instead
+///       when another device on the bus needs it meanwhile. Always single lane, the read cache is bypassed.
+uint32_t SPIFlash::readStream(uint32_t addr, uint32_t len, SPIFlashSink sink, void* context) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return 0;
+  if (_wcache) flushRange(addr, len);
+  bool suspended = suspendErase();
+  uint8_t buf[SPIFLASH_STREAMCHUNK];
+  uint32_t done = 0;
+  if (!command(SPIFLASH_ARRAYREAD)) {
+    if (suspended) resumeErase();
+    return 0;
+  }
+  sendAddress(addr);
+  transfer(0); //"dont care"
+  while (done < len) {
+    uint16_t n = len - done < SPIFLASH_STREAMCHUNK ? len - done : SPIFLASH_STREAMCHUNK;
+    readPayload(buf, n);
+    done += n;
+    if (!sink(buf, n, context)) break;
+  }
+  unselect();
+  if (suspended) resumeErase();
+  return done;
+}
+
+static bool printSink(const uint8_t* buf, uint16_t len, void* context) {
+  return ((Print*) context)->write(buf, len) == len;
+}
+
+/// readStream() into an Arduino Print (ie. Serial or a network client), ends early if out stops accepting bytes
+uint32_t SPIFlash::readStream(uint32_t addr, uint32_t len, Print& out) {
+  return readStream(addr, len, printSink, &out);
+}
+
+/// one Byte/Page Program command of len bytes of buf followed by moreLen bytes of more, the range must stay within a page
+/// Returns false if the chip timed out before it
+bool SPIFlash::programPage(uint32_t addr, const void* buf, uint16_t len, const void* more, uint16_t moreLen) {
+  if (_quadProgram) {
+    if (!len) return programPage(addr, more, moreLen);
+    if (moreLen)  // the quad transport takes a single buffer
+      return programPage(addr, buf, len) && programPage(addr + len, more, moreLen);
+    if (!command(SPIFLASH_WRITEENABLE)) return false; // Write Enable
+    unselect();
+    _multiIO->program(_addr4Opcodes ? SPIFLASH_QUADPAGEPROGRAM4B : SPIFLASH_QUADPAGEPROGRAM, addr, _info.addressBytes, 4, buf, len);
+#ifdef SPIFLASH_ENABLE_STATS
+    _stats.pagePrograms++;
+    _stats.bytesWritten += len;
+#endif
+    _waitCmd = SPIFLASH_BYTEPAGEPROGRAM;
+    _waitStart = micros();
+    return true;
+  }
+  if (!command(SPIFLASH_BYTEPAGEPROGRAM, true)) return false;  // Byte/Page Program
+  sendAddress(addr);
+  if (len) writePayload(buf, len);
+  if (moreLen) writePayload(more, moreLen);
+  unselect();
+  return true;
+}
+
+/// enable the write-back page cache with count caller-owned pages (NULL/0 flushes and disables it)
+/// Example: SPIFlashCachePage cache[2]; flash.setWriteCache(cache, 2);
+/// writeByte/writeBytes then only land in RAM until the page is full, its slot is reused, or flush()
+/// reads flush the pages they overlap first, erases drop the cached data they cover
+/// NOTE: the async and queue calls bypass the cache, flush() before using them on cached pages
+void SPIFlash::setWriteCache(SPIFlashCachePage* pages, uint8_t count) {
+  SPIFLASH_LOCK();
+  flush();
+  _wcache = count ? pages : NULL;
+  _wcacheCount = count;
+  _wcacheTick = 0;
+  for (uint8_t i = 0; i < _wcacheCount; i++) {
+    _wcache[i].addr = SPIFLASH_NOPAGE;
+    _wcache[i].stamp = 0;
+  }
+}
+
+/// program every dirty cached page
+void SPIFlash::flush() {
+  SPIFLASH_LOCK();
+  for (uint8_t i = 0; i < _wcacheCount; i++) flushPage(_wcache[i]);
+}
+
+/// bytes covered by a write cache slot: the chip's page size, capped to SPIFlashCachePage::data
+uint16_t SPIFlash::cachePageSize() {
+  return _info.pageSize < sizeof(_wcache->data) ? _info.pageSize : sizeof(_wcache->data);
+}
+
+void SPIFlash::cacheWrite(uint32_t addr, const uint8_t* buf, uint32_t len) {
+  uint16_t size = cachePageSize();
+  while (len > 0) {
+    uint32_t pageAddr = addr & ~(uint32_t)(size - 1);
+    uint8_t offset = addr - pageAddr;
+    uint16_t n = size - offset;
+    if (n > len) n = len;
+
+    SPIFlashCachePage* page = NULL;
+    SPIFlashCachePage* victim = &_wcache[0];
+    for (uint8_t i = 0; i < _wcacheCount && !page; i++) {
+      if (_wcache[i].addr == pageAddr) page = &_wcache[i];
+      else if (_wcache[i].addr == SPIFLASH_NOPAGE) victim = &_wcache[i];
+      else if (victim->addr != SPIFLASH_NOPAGE && (uint16_t)(_wcacheTick - _wcache[i].stamp) > (uint16_t)(_wcacheTick - victim->stamp)) victim = &_wcache[i];
+    }
+    if (!page) {
+      flushPage(*victim);
+      page = victim;
+      page->addr = pageAddr;
+      page->lo = offset;
+      page->hi = offset;
+      memset(page->data, 0xFF, size);
+    }
+    page->stamp = ++_wcacheTick;
+    for (uint16_t i = 0; i < n; i++) page->data[offset + i] &= buf[i];  // programming can only clear bits, same as the chip
+    if (offset < page->lo) page->lo = offset;
+    if (offset + n - 1 > page->hi) page->hi = offset + n - 1;
+    if (page->lo == 0 && page->hi == size - 1) flushPage(*page);
+
+    addr += n;
+    buf += n;
     len -= n;
-    maxBytes = 256;   // now we can do up to 256 bytes per loop
   }
 }
 
+void SPIFlash::flushPage(SPIFlashCachePage& page) {
+  if (page.addr == SPIFLASH_NOPAGE) return;
+  uint32_t pageAddr = page.addr;
+  page.addr = SPIFLASH_NOPAGE;
+  programBytes(pageAddr + page.lo, page.data + page.lo, page.hi - page.lo + 1);
+}
+
+/// program the cached pages that overlap [addr, addr+len)
+void SPIFlash::flushRange(uint32_t addr, uint32_t len) {
+  for (uint8_t i = 0; i < _wcacheCount; i++)
+    if (_wcache[i].addr != SPIFLASH_NOPAGE && _wcache[i].addr + cachePageSize() > addr && _wcache[i].addr < addr + len)
+      flushPage(_wcache[i]);
+}
+
+/// forget the cached pages inside an erased range
+void SPIFlash::discardRange(uint32_t addr, uint32_t len) {
+  for (uint8_t i = 0; i < _wcacheCount; i++)
+    if (_wcache[i].addr >= addr && _wcache[i].addr - addr < len)
+      _wcache[i].addr = SPIFLASH_NOPAGE;
+}
+
 /// erase entire flash memory array
 /// may take several seconds depending on size, but is non blocking
 /// so you may wait for this to complete using busy() or continue doing
@@ -229,41 +1318,367 @@ void SPIFlash::writeBytes(uint32_t addr, const void* buf, uint16_t len) {
 /// note that any command will first wait for chip to become available using busy()
 /// so no need to do that twice
 void SPIFlash::chipErase() {
-  command(SPIFLASH_CHIPERASE, true);
-  unselect();
+  SPIFLASH_LOCK();
+  for (uint8_t i = 0; i < _rcacheCount; i++) _rcache[i].addr = SPIFLASH_NOPAGE;
+  for (uint8_t i = 0; i < _wcacheCount; i++) _wcache[i].addr = SPIFLASH_NOPAGE;
+  if (command(SPIFLASH_CHIPERASE, true)) unselect();
 }
 
 /// erase a 4Kbyte block
 void SPIFlash::blockErase4K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_4K, true); // Block Erase
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
-  unselect();
+  SPIFLASH_LOCK();
+  eraseBlock(addr, 12);
 }
 
 /// erase a 32Kbyte block
 void SPIFlash::blockErase32K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_32K, true); // Block Erase
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
-  unselect();
+  SPIFLASH_LOCK();
+  eraseBlock(addr, 15);
 }
 
 /// erase a 64Kbyte block
 void SPIFlash::blockErase64K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_64K, true); // Block Erase
-  _spi->transfer(addr >> 16);
-  _spi->transfer(addr >> 8);
-  _spi->transfer(addr);
+  SPIFLASH_LOCK();
+  eraseBlock(addr, 16);
+}
+
+/// erase the 2^sizeLog2 block containing addr with the matching erase type from the chip descriptor,
+/// or with a run of the next smaller erase type when the chip has no erase of that size
+void SPIFlash::eraseBlock(uint32_t addr, uint8_t sizeLog2) {
+  uint32_t size = 1UL << sizeLog2;
+  addr &= ~(size-1);
+  if (!inRange(addr, size)) return;
+  if (_wcache) discardRange(addr, size);
+  if (_rcache) invalidateLines(addr, size);
+  uint8_t opcode = eraseOpcode(sizeLog2);
+  if (opcode) {
+    if (!command(opcode, true)) return; // Block Erase
+    sendAddress(addr);
+    unselect();
+    _waitAddr = addr;
+    return;
+  }
+  uint8_t smaller = 0;
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++)
+    if (_info.eraseSizeLog2[i] < sizeLog2 && _info.eraseSizeLog2[i] > smaller) smaller = _info.eraseSizeLog2[i];
+  if (!smaller) return;
+  for (uint32_t offset = 0; offset < size; offset += 1UL << smaller) eraseBlock(addr + offset, smaller);
+}
+
+/// erase an arbitrary range with the fewest erase commands: at each step the largest erase type that is
+/// aligned at the current address and fits in what is left, or chipErase() when the range is the whole chip
+/// addr and len must be multiples of the smallest erase size (usually 4K), returns false otherwise
+/// skipBlank first reads each block and skips the erase when it is already all 0xFF (no chip erase then)
+/// Example: eraseRange(0x100000, 0x100000) erases a 1MB partition with 16 64K erases instead of 256 4K ones
+bool SPIFlash::eraseRange(uint32_t addr, uint32_t len, bool skipBlank) {
+  SPIFLASH_LOCK();
+  uint8_t smallest = 0xFF;
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++)
+    if (_info.eraseSizeLog2[i] && _info.eraseSizeLog2[i] < smallest) smallest = _info.eraseSizeLog2[i];
+  if (smallest == 0xFF) return false;
+  uint32_t mask = (1UL << smallest) - 1;
+  if ((addr & mask) || (len & mask) || !inRange(addr, len)) return false;
+
+  if (!skipBlank && addr == 0 && len && len == _info.capacity) {
+    chipErase();
+    return true;
+  }
+  while (len > 0) {
+    uint8_t sizeLog2 = smallest;
+    for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++) {
+      uint8_t candidate = _info.eraseSizeLog2[i];
+      if (candidate > sizeLog2 && candidate < 32 && !(addr & ((1UL << candidate) - 1)) && len >= (1UL << candidate)) sizeLog2 = candidate;
+    }
+    uint32_t size = 1UL << sizeLog2;
+    if (!skipBlank || !isBlank(addr, size)) eraseBlock(addr, sizeLog2);
+    addr += size;
+    len -= size;
+  }
+  return true;
+}
+
+/// erase opcode for a block size, 0 if the chip has no such erase type
+uint8_t SPIFlash::eraseOpcode(uint8_t sizeLog2) {
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++)
+    if (_info.eraseSizeLog2[i] == sizeLog2) return _info.eraseOpcode[i];
+  return 0;
+}
+
+/// block size (log2) erased by an opcode, 0 if it is not a block erase
+uint8_t SPIFlash::eraseSizeLog2(uint8_t opcode) {
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++)
+    if (_info.eraseSizeLog2[i] && _info.eraseOpcode[i] == opcode) return _info.eraseSizeLog2[i];
+  return 0;
+}
+
+/// Non-blocking erase/program queue
+/// The queue calls below only record the operation and return a token right away. They return 0 when nothing
+/// was queued: lastError() then tells a full queue (SPIFLASH_ERR_QUEUEFULL) from a bad range (SPIFLASH_ERR_RANGE).
+/// Call service() regularly (ie. every loop) to issue queued operations as soon as the chip is ready,
+/// one status read per call; it never waits on busy(). Check progress with opStatus(token) or isIdle().
+/// NOTE: blocking calls (readBytes, writeBytes, ...) are not ordered against queued operations, they only
+///       wait for whatever the chip is currently doing. Drain the queue first when that matters.
+uint8_t SPIFlash::queueChipErase() {
+  return queueOp(SPIFLASH_CHIPERASE, 0, NULL, 0);
+}
+
+/// queued erases need an erase type of exactly that size on the chip, otherwise they return 0
+uint8_t SPIFlash::queueBlockErase4K(uint32_t addr) {
+  return eraseOpcode(12) ? queueOp(eraseOpcode(12), addr, NULL, 0) : 0;
+}
+
+uint8_t SPIFlash::queueBlockErase32K(uint32_t addr) {
+  return eraseOpcode(15) ? queueOp(eraseOpcode(15), addr, NULL, 0) : 0;
+}
+
+uint8_t SPIFlash::queueBlockErase64K(uint32_t addr) {
+  return eraseOpcode(16) ? queueOp(eraseOpcode(16), addr, NULL, 0) : 0;
+}
+
+/// queue a write of up to 64K, programmed one page per service() step
+/// buf must stay valid until the operation is done
+uint8_t SPIFlash::queueWriteBytes(uint32_t addr, const void* buf, uint16_t len) {
+  if (len == 0) return 0;
+  return queueOp(SPIFLASH_BYTEPAGEPROGRAM, addr, buf, len);
+}
+
+/// queue a read into buf, done by the next service() unless it overlaps a write or erase queued before it
+/// Reads skip ahead of the writes and erases they do not depend on, and all ready reads go out in the same
+/// service() call; a running erase is suspended for them (see setReadSuspend), a running page program waited for.
+uint8_t SPIFlash::queueReadBytes(uint32_t addr, void* buf, uint16_t len) {
+  if (len == 0) return 0;
+  return queueOp(SPIFLASH_ARRAYREAD, addr, buf, len);
+}
+
+uint8_t SPIFlash::queueOp(uint8_t cmd, uint32_t addr, const void* buf, uint16_t len) {
+  SPIFLASH_LOCK();
+  if (cmd != SPIFLASH_CHIPERASE && !inRange(addr, len ? len : 1)) return 0;
+  if (_opCount >= SPIFLASH_OPQUEUE_SIZE) {
+    _lastError = SPIFLASH_ERR_QUEUEFULL;
+    return 0;
+  }
+  SPIFlashOp& op = _ops[(_opHead + _opCount) % SPIFLASH_OPQUEUE_SIZE];
+  if (++_opLastToken == 0) _opLastToken = 1; // token 0 is reserved for "not queued"
+  op.token = _opLastToken;
+  op.state = SPIFLASH_OP_QUEUED;
+  op.cmd = cmd;
+  op.addr = addr;
+  op.buf = (const uint8_t*) buf;
+  op.len = len;
+  _opCount++;
+#ifdef SPIFLASH_RTOS
+  if (_worker) xTaskNotifyGive(_worker);
+#endif
+  return op.token;
+}
+
+/// issue the operation (or its next page), only called when the chip is not busy
+void SPIFlash::startOp(SPIFlashOp& op) {
+  if (_rcache) {
+    uint8_t sizeLog2 = eraseSizeLog2(op.cmd);
+    if (op.cmd == SPIFLASH_BYTEPAGEPROGRAM) invalidateLines(op.addr, op.len);
+    else if (sizeLog2) invalidateLines(op.addr & ~((1UL << sizeLog2)-1), 1UL << sizeLog2);
+    else invalidateLines(0, SPIFLASH_NOPAGE);
+  }
+  if (!command(op.cmd, true)) return;  // timed out, the operation stays queued
+  if (op.cmd != SPIFLASH_CHIPERASE) {
+    sendAddress(op.addr);
+  }
+  if (eraseSizeLog2(op.cmd)) _waitAddr = op.addr & ~((1UL << eraseSizeLog2(op.cmd)) - 1);
+  if (op.cmd == SPIFLASH_BYTEPAGEPROGRAM) {
+    uint16_t n = _info.pageSize-(op.addr%_info.pageSize);  // stay within the current page
+    if (n > op.len) n = op.len;
+    writePayload(op.buf, n);
+    op.addr += n;
+    op.buf += n;
+    op.len -= n;
+  }
   unselect();
+  op.state = SPIFLASH_OP_RUNNING;
+}
+
+/// advance the queue by at most one step without waiting, returns true when the queue is empty
+bool SPIFlash::service() {
+  SPIFLASH_LOCK();
+  serviceReads();
+  if (_opCount == 0) {
+    autoSleep();
+    return true;
+  }
+  if (_waitCmd) {
+    uint32_t typUs, maxUs;
+    expectedTime(_waitCmd, typUs, maxUs);
+    if (micros() - _waitStart < typUs) return false;  // not worth a status read yet
+  }
+  if (busy()) return false;
+  _waitCmd = 0;
+  SPIFlashOp& op = _ops[_opHead];
+  if (op.state == SPIFLASH_OP_RUNNING && op.len == 0) {
+    op.state = SPIFLASH_OP_DONE;
+    _opHead = (_opHead + 1) % SPIFLASH_OPQUEUE_SIZE;
+    _opCount--;
+    serviceReads();  // reads that waited for this operation
+    if (_opCount == 0) return true;
+  }
+  startOp(_ops[_opHead]);
+  return false;
+}
+
+/// run every queued read that does not overlap a write or erase queued before it, and drop it from the queue
+void SPIFlash::serviceReads() {
+  uint8_t i = 0;
+  while (i < _opCount) {
+    SPIFlashOp& op = _ops[(_opHead + i) % SPIFLASH_OPQUEUE_SIZE];
+    bool ready = op.cmd == SPIFLASH_ARRAYREAD;
+    for (uint8_t j = 0; ready && j < i; j++) {
+      SPIFlashOp& prev = _ops[(_opHead + j) % SPIFLASH_OPQUEUE_SIZE];
+      if (prev.cmd == SPIFLASH_ARRAYREAD) continue;
+      if (prev.cmd == SPIFLASH_CHIPERASE) ready = false;
+      uint32_t start = prev.addr, size = prev.len;
+      uint8_t sizeLog2 = eraseSizeLog2(prev.cmd);
+      if (sizeLog2) {
+        size = 1UL << sizeLog2;
+        start &= ~(size - 1);
+      }
+      if (start < op.addr + op.len && op.addr < start + size) ready = false;
+    }
+    if (!ready) {
+      i++;
+      continue;
+    }
+    readBytes(op.addr, (uint8_t*) op.buf, op.len);
+    for (uint8_t j = i; j + 1 < _opCount; j++)
+      _ops[(_opHead + j) % SPIFLASH_OPQUEUE_SIZE] = _ops[(_opHead + j + 1) % SPIFLASH_OPQUEUE_SIZE];
+    _opCount--;
+  }
+}
+
+/// true when every queued operation has completed
+bool SPIFlash::isIdle() {
+  return _opCount == 0;
+}
+
+/// run a list of operations (see SPIFlashBatchOp) under one SPI transaction: between commands, write enables
+/// included, only chip select is toggled. The bus is let go while waiting for a program/erase to finish and at
+/// the end. Reads and programs go through the caches as readBytes/writeBytes do.
+/// With a SPIFlashBus or a multi-IO transport the operations simply run one after the other.
+/// Returns false, before running anything, if an operation has an unknown cmd
+bool SPIFlash::runBatch(SPIFlashBatchOp* ops, uint8_t count) {
+  SPIFLASH_LOCK();
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t cmd = ops[i].cmd;
+    if (cmd != SPIFLASH_ARRAYREAD && cmd != SPIFLASH_BYTEPAGEPROGRAM && cmd != SPIFLASH_STATUSREAD &&
+        cmd != SPIFLASH_CHIPERASE && !eraseSizeLog2(cmd)) return false;
+  }
+  if (_asyncActive) while (!asyncDone());
+  if (!_bus && !_multiIO) holdBus();
+  for (uint8_t i = 0; i < count; i++) {
+    SPIFlashBatchOp& op = ops[i];
+    switch (op.cmd) {
+      case SPIFLASH_ARRAYREAD:       readBytes(op.addr, op.buf, op.len); break;
+      case SPIFLASH_BYTEPAGEPROGRAM: writeBytes(op.addr, op.buf, op.len); break;
+      case SPIFLASH_STATUSREAD:      *(uint8_t*) op.buf = readStatus(); break;
+      case SPIFLASH_CHIPERASE:       chipErase(); break;
+      default:                       eraseBlock(op.addr, eraseSizeLog2(op.cmd));
+    }
+  }
+  if (_busHeld) releaseBus();
+  return true;
+}
+
+/// SPIFLASH_OP_QUEUED/RUNNING while the token is in the queue, SPIFLASH_OP_DONE once it left
+uint8_t SPIFlash::opStatus(uint8_t token) {
+  SPIFLASH_LOCK();
+  for (uint8_t i = 0; i < _opCount; i++) {
+    SPIFlashOp& op = _ops[(_opHead + i) % SPIFLASH_OPQUEUE_SIZE];
+    if (op.token == token) return op.state;
+  }
+  return SPIFLASH_OP_DONE;
+}
+
+/// block until the queued operation is done, advancing the queue with service() unless a worker task does
+void SPIFlash::waitOp(uint8_t token) {
+  while (opStatus(token) != SPIFLASH_OP_DONE) {
+#ifdef SPIFLASH_RTOS
+    if (_worker) {
+      vTaskDelay(1);
+      continue;
+    }
+#endif
+    service();
+    yield();
+  }
 }
 
+/// hold this chip for a sequence of calls from the current task (ie. command() followed by reads), see SPIFLASH_RTOS
+/// Public calls take the same recursive lock, so they can be used in between. Does nothing without SPIFLASH_RTOS.
+void SPIFlash::lock() {
+#ifdef SPIFLASH_RTOS
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+#endif
+}
+
+void SPIFlash::unlock() {
+#ifdef SPIFLASH_RTOS
+  xSemaphoreGiveRecursive(_mutex);
+#endif
+}
+
+#ifdef SPIFLASH_RTOS
+/// start a task that advances the queue, so other tasks only queue operations and waitOp() on them
+/// It sleeps while the queue is empty and wakes up as soon as something is queued.
+bool SPIFlash::startWorker(UBaseType_t priority, uint32_t stackSize) {
+  if (_worker) return true;
+  _workerStop = false;
+  if (xTaskCreate(workerTask, "spiflash", stackSize, this, priority, &_worker) == pdPASS) return true;
+  _worker = NULL;
+  return false;
+}
+
+/// let the worker task exit and wait until it has, queued operations then wait for service() calls again
+/// Do not call it from the worker itself (ie. from an async callback)
+void SPIFlash::stopWorker() {
+  lock();
+  TaskHandle_t worker = _worker;
+  if (worker) {
+    // the worker only reads _workerStop under the lock, so it is still alive for this notification
+    _workerStop = true;
+    xTaskNotifyGive(worker);
+  }
+  unlock();
+  if (!worker) return;
+  xSemaphoreTake(_workerDone, portMAX_DELAY);
+  _worker = NULL;
+}
+
+void SPIFlash::workerTask(void* self) {
+  SPIFlash& flash = *(SPIFlash*) self;
+  for (;;) {
+    flash.lock();
+    bool stop = flash._workerStop;
+    flash.unlock();
+    if (stop) break;
+    // while an operation runs, check again every tick or as soon as a read is queued
+    // once idle, come back when the chip is due for auto sleep
+    TickType_t wait = 1;
+    if (flash.service()) wait = flash._autoSleepMs && !flash._asleep ? pdMS_TO_TICKS(flash._autoSleepMs) + 1 : portMAX_DELAY;
+    ulTaskNotifyTake(pdTRUE, wait);
+  }
+  xSemaphoreGive(flash._workerDone);  // stopWorker() no longer touches the task handle after this
+  vTaskDelete(NULL);
+}
+#endif
+
 /// found() - checks there is a FLASH chip by checking the deviceID repeatedly - should be a consistent value
+/// After a successful initialize() a single ID read is compared with the JEDEC ID cached in chipInfo()
 uint8_t SPIFlash::found() {
+  SPIFLASH_LOCK();
   uint16_t deviceID=0;
-  wakeup(); //if sleep() was previously called, wakeup() is required or it's non responsive
+  wakeup(); //if sleep() was previously called, wakeup() is required or it's non responsive (free when awake)
+  if (_info.jedecID && _info.jedecID != 0xFFFFFF) {
+    if (_waitCmd) waitReady();  // the ID read is ignored while a program/erase runs
+    return readDeviceId() == (uint16_t) (_info.jedecID >> 8);
+  }
   for (uint8_t i=0;i<10;i++) {
     uint16_t idNow = readDeviceId();
     if (idNow==0 || idNow==0xffff || (i>0 && idNow != deviceID)) {
@@ -278,34 +1693,386 @@ uint8_t SPIFlash::found() {
   return true;
 }
 
+/// read len bytes at offset of security register reg (1..SPIFLASH_SECREGCOUNT), false if that is out of the register
+bool SPIFlash::readSecurityRegister(uint8_t reg, uint16_t offset, void* buf, uint16_t len) {
+  SPIFLASH_LOCK();
+  if (!securityCommand(SPIFLASH_SECREGREAD, reg, offset, len)) return false;
+  transfer(0); //"dont care"
+  readPayload(buf, len);
+  unselect();
+  return true;
+}
+
+/// program len bytes at offset of security register reg, only clears bits like writeBytes (erase it first)
+/// Nothing changes once the register is locked.
+bool SPIFlash::programSecurityRegister(uint8_t reg, uint16_t offset, const void* buf, uint16_t len) {
+  SPIFLASH_LOCK();
+  if (!securityCommand(SPIFLASH_SECREGPROGRAM, reg, offset, len)) return false;
+  writePayload(buf, len);
+  unselect();
+  return true;
+}
+
+bool SPIFlash::eraseSecurityRegister(uint8_t reg) {
+  SPIFLASH_LOCK();
+  if (!securityCommand(SPIFLASH_SECREGERASE, reg, 0, 0)) return false;
+  unselect();
+  return true;
+}
+
+/// WARNING: permanent, the register can never be erased or programmed again
+/// Sets its lock bit in status register 2, written the way enableQuad() writes QE. Returns true once the bit reads back set
+bool SPIFlash::lockSecurityRegister(uint8_t reg) {
+  SPIFLASH_LOCK();
+  if (reg < 1 || reg > SPIFLASH_SECREGCOUNT) return false;
+  uint8_t sr1 = readStatus();
+  if (!command(SPIFLASH_STATUS2READ)) return false;
+  uint8_t sr2 = transfer(0);
+  unselect();
+  if (_info.quadEnable == 6) {
+    if (!command(SPIFLASH_STATUS2WRITE, true)) return false;
+  }
+  else {
+    if (!command(SPIFLASH_STATUSWRITE, true)) return false;
+    transfer(sr1);
+  }
+  transfer(sr2 | (0x04 << reg));
+  unselect();
+  return isSecurityRegisterLocked(reg);
+}
+
+bool SPIFlash::isSecurityRegisterLocked(uint8_t reg) {
+  SPIFLASH_LOCK();
+  if (reg < 1 || reg > SPIFLASH_SECREGCOUNT || !command(SPIFLASH_STATUS2READ)) return false;
+  uint8_t sr2 = transfer(0);
+  unselect();
+  return sr2 & (0x04 << reg);
+}
+
 ///regionIsEmpty() - check a random flashmem byte array is all clear and can be written to (ie. it's all 0xff)
 uint8_t SPIFlash::regionIsEmpty(uint32_t startAddress, uint8_t length) {
-  uint8_t flashBuf[length];
-  readBytes(startAddress, flashBuf, length);
-  for (uint8_t i=0;i<length;i++) if (flashBuf[i]!=0xff) return false;
+  SPIFLASH_LOCK();
+  return isBlank(startAddress, length);
+}
+
+/// isBlank() - check a range of any size is all 0xFF, ie. a whole sector or partition
+/// streams through one read transaction in small chunks, compares a 32 bit word at a time and stops at
+/// the first word that is not blank; firstDirty (optional) gets the address of the first non-0xFF byte
+bool SPIFlash::isBlank(uint32_t addr, uint32_t len, uint32_t* firstDirty) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return false;
+  if (_wcache) flushRange(addr, len);
+  uint32_t words[SPIFLASH_TXCHUNK/4];
+  uint32_t offset = 0;
+  bool blank = true;
+  if (!command(SPIFLASH_ARRAYREAD)) return false;
+  sendAddress(addr);
+  transfer(0); //"dont care"
+  while (offset < len && blank) {
+    uint8_t n = (len - offset < SPIFLASH_TXCHUNK) ? len - offset : SPIFLASH_TXCHUNK;
+    if (n < SPIFLASH_TXCHUNK) memset(words, 0xFF, sizeof(words));  // pad a short last chunk
+    readPayload(words, n);
+    uint8_t w = 0;
+    while (w < SPIFLASH_TXCHUNK/4 && words[w] == 0xFFFFFFFFUL) w++;
+    if (w < SPIFLASH_TXCHUNK/4) {
+      blank = false;
+      uint8_t i = w*4;
+      while (((uint8_t*) words)[i] == 0xFF) i++;
+      offset += i;
+    }
+    else offset += n;
+  }
+  unselect();
+  if (firstDirty) *firstDirty = blank ? 0xFFFFFFFF : addr + offset;
+  return blank;
+}
+
+static bool crcSink(const uint8_t* buf, uint16_t len, void* context) {
+  *(uint32_t*) context = SPIFlash::crc32Update(*(uint32_t*) context, buf, len);
   return true;
 }
 
-/// Put flash memory chip into power down mode
+/// CRC-32 (as zlib's crc32()) of a range of any size, computed while it streams through one read transaction
+/// Pass the result of a previous call as crc to continue over the next range
+uint32_t SPIFlash::crc32(uint32_t addr, uint32_t len, uint32_t crc) {
+  readStream(addr, len, crcSink, &crc);
+  return crc;
+}
+
+/// continue a CRC-32 over RAM data, ie. to compute the expected value of an image before writing it
+uint32_t SPIFlash::crc32Update(uint32_t crc, const void* buf, uint16_t len) {
+#ifdef SPIFLASH_ROMCRC32
+  return SPIFLASH_ROMCRC32(crc, (const uint8_t*) buf, len);
+#else
+  const uint8_t* p = (const uint8_t*) buf;
+  crc = ~crc;
+  while (len--) {
+    crc = SPIFLASH_CRCTABLE((crc ^ *p) & 0x0F) ^ (crc >> 4);
+    crc = SPIFLASH_CRCTABLE((crc ^ (*p++ >> 4)) & 0x0F) ^ (crc >> 4);
+  }
+  return ~crc;
+#endif
+}
+
+static bool compareSink(const uint8_t* buf, uint16_t len, void* context) {
+  const uint8_t** expected = (const uint8_t**) context;
+  if (memcmp(buf, *expected, len)) {
+    *expected = NULL;
+    return false;
+  }
+  *expected += len;
+  return true;
+}
+
+/// true when flash holds exactly len bytes of buf at addr, streamed through one read transaction
+/// without a verify buffer; stops at the first chunk that differs
+bool SPIFlash::compare(uint32_t addr, const void* buf, uint32_t len) {
+  const uint8_t* expected = (const uint8_t*) buf;
+  if (!inRange(addr, len)) return false;
+  return readStream(addr, len, compareSink, &expected) == len && expected != NULL;
+}
+
+/// writeBytes() then compare(), false if the chip did not take the data (not erased, protected, worn out)
+bool SPIFlash::writeVerify(uint32_t addr, const void* buf, uint32_t len) {
+  writeBytes(addr, buf, len);
+  return compare(addr, buf, len);
+}
+
+/// Delta write: make len bytes at addr equal to buf with as little programming and erasing as possible.
+/// Each 4K sector of the range is compared first: unchanged sectors are skipped, changes that only clear
+/// bits (1->0) are programmed in place, page by page over the changed bytes only. Only a sector with a bit
+/// going 0->1 is erased, and that goes through the scratch sectors (see setUpdateScratch), so a power loss
+/// never leaves it half written. Returns false if a sector needs an erase and no scratch is set, the
+/// range overlaps the scratch sectors, or the chip timed out (lastError()).
+/// Example: flash.setUpdateScratch(0x7E000); ... flash.update(CONFIG_ADDR, &config, sizeof(config));
+bool SPIFlash::update(uint32_t addr, const void* buf, uint32_t len) {
+  SPIFLASH_LOCK();
+  if (!inRange(addr, len)) return false;
+  if (_updateScratch != SPIFLASH_NOPAGE && addr < _updateScratch + 0x2000 && _updateScratch < addr + len) return false;
+  const uint8_t* in = (const uint8_t*) buf;
+  uint8_t dirtyLo[16], dirtyHi[16];
+  while (len) {
+    uint32_t sector = addr & ~0xFFFUL;
+    uint16_t n = sector + 0x1000 - addr < len ? sector + 0x1000 - addr : len;
+    uint8_t plan = planUpdate(addr, in, n, dirtyLo, dirtyHi);
+    if (plan == SPIFLASH_UPDATE_FAILED || (plan == SPIFLASH_UPDATE_ERASE && !rewriteSector(sector, addr, in, n))) return false;
+    if (plan == SPIFLASH_UPDATE_PROGRAM) {
+      for (uint8_t p = 0; p < 16; p++) {
+        if (dirtyLo[p] > dirtyHi[p]) continue;
+        uint32_t from = sector + p * 256UL + dirtyLo[p];
+        bool ok = programBytes(from, in + (from - addr), dirtyHi[p] - dirtyLo[p] + 1);
+        if (_rcache) invalidateLines(from, dirtyHi[p] - dirtyLo[p] + 1);
+        if (!ok) return false;
+      }
+    }
+    addr += n;
+    in += n;
+    len -= n;
+  }
+  return true;
+}
+
+struct SPIFlashUpdatePlan {
+  const uint8_t* expected;
+  uint16_t offset;            // from the start of the sector
+  uint8_t plan;
+  uint8_t* dirtyLo;
+  uint8_t* dirtyHi;
+};
+
+static bool planSink(const uint8_t* buf, uint16_t len, void* context) {
+  SPIFlashUpdatePlan& p = *(SPIFlashUpdatePlan*) context;
+  for (uint16_t i = 0; i < len; i++, p.offset++) {
+    uint8_t want = *p.expected++;
+    if (buf[i] == want) continue;
+    if ((buf[i] & want) != want) {
+      p.plan = SPIFLASH_UPDATE_ERASE;
+      return false;
+    }
+    p.plan = SPIFLASH_UPDATE_PROGRAM;
+    uint8_t page = p.offset >> 8, at = p.offset & 0xFF;
+    if (at < p.dirtyLo[page]) p.dirtyLo[page] = at;
+    if (at > p.dirtyHi[page]) p.dirtyHi[page] = at;
+  }
+  return true;
+}
+
+/// compare len bytes at addr (within one sector) with buf, dirtyLo/Hi get the changed span of each page of
+/// the sector (lo > hi when the page is unchanged)
+uint8_t SPIFlash::planUpdate(uint32_t addr, const uint8_t* buf, uint16_t len, uint8_t* dirtyLo, uint8_t* dirtyHi) {
+  SPIFlashUpdatePlan p = { buf, (uint16_t) (addr & 0xFFF), SPIFLASH_UPDATE_SAME, dirtyLo, dirtyHi };
+  memset(dirtyLo, 0xFF, 16);
+  memset(dirtyHi, 0, 16);
+  if (readStream(addr, len, planSink, &p) < len && p.plan != SPIFLASH_UPDATE_ERASE) return SPIFLASH_UPDATE_FAILED;
+  return p.plan;
+}
+
+/// rebuild the sector with the new bytes in the scratch sector, journal it, then erase and rewrite the target
+bool SPIFlash::rewriteSector(uint32_t sector, uint32_t addr, const uint8_t* buf, uint16_t len) {
+  if (_updateScratch == SPIFLASH_NOPAGE) return false;
+  uint32_t journal = _updateScratch + 0x1000;
+  uint8_t page[256];
+  uint32_t crc = 0;
+  blockErase4K(_updateScratch);
+  for (uint16_t offset = 0; offset < 0x1000; offset += 256) {
+    uint32_t from = sector + offset;
+    if (!readArray(from, page, 256)) return false;
+    for (uint16_t i = 0; i < 256; i++)
+      if (from + i >= addr && from + i < addr + len) page[i] = buf[from + i - addr];
+    crc = crc32Update(crc, page, 256);
+    uint16_t i = 0;
+    while (i < 256 && page[i] == 0xFF) i++;
+    if (i < 256 && !programPage(_updateScratch + offset, page, 256)) return false;
+  }
+  uint8_t record[SPIFLASH_UPDATE_RECORD];
+  for (uint8_t i = 0; i < 4; i++) record[4 + i] = sector >> (8 * i);
+  crc = crc32Update(crc, record + 4, 4);
+  uint32_t last;
+  uint32_t slot = journalSlot(last);
+  if (slot >= journal + 0x1000) {
+    blockErase4K(journal);  // full, and every record in it is done
+    slot = journal;
+  }
+  for (uint8_t i = 0; i < 4; i++) {
+    record[i] = (uint32_t) SPIFLASH_UPDATE_MAGIC >> (8 * i);
+    record[8 + i] = crc >> (8 * i);
+  }
+  memset(record + 12, 0xFF, 4);
+  bool ok = programBytes(slot, record, SPIFLASH_UPDATE_RECORD);
+  if (_rcache) invalidateLines(_updateScratch, 0x2000);  // the scratch and journal are read past the cache, keep them out of it
+  if (!ok || !copySector(_updateScratch, sector, page)) return false;  // a journalled record is finished by the next setUpdateScratch()
+  uint8_t done = 0;
+  ok = programBytes(slot + 12, &done, 1);
+  if (_rcache) invalidateLines(slot + 12, 1);
+  return ok;
+}
+
+/// erase to and copy from into it through the 256 byte buffer page, skipping blank pages
+/// Returns false if the chip timed out part way
+bool SPIFlash::copySector(uint32_t from, uint32_t to, uint8_t* page) {
+  bool ok = true;
+  blockErase4K(to);
+  for (uint16_t offset = 0; offset < 0x1000 && ok; offset += 256) {
+    ok = readArray(from + offset, page, 256);
+    uint16_t i = 0;
+    while (ok && i < 256 && page[i] == 0xFF) i++;
+    if (ok && i < 256) ok = programPage(to + offset, page, 256);
+  }
+  if (_rcache) invalidateLines(to, 0x1000);
+  return ok;
+}
+
+/// first free record of the update journal (the end of the journal sector when it is full), last gets the
+/// newest record (SPIFLASH_NOPAGE when there is none)
+uint32_t SPIFlash::journalSlot(uint32_t& last) {
+  uint32_t journal = _updateScratch + 0x1000, slot = journal;
+  uint32_t magic;
+  last = SPIFLASH_NOPAGE;
+  for (; slot < journal + 0x1000; slot += SPIFLASH_UPDATE_RECORD) {
+    readArray(slot, &magic, 4);
+    if (magic == 0xFFFFFFFFUL) break;
+    last = slot;
+  }
+  return slot;
+}
+
+/// address of the scratch sectors of update(), SPIFLASH_NOPAGE when none is set
+uint32_t SPIFlash::updateScratch() {
+  return _updateScratch;
+}
+
+/// reserve two 4K sectors at addr (4K aligned, outside any data update() writes) as the scratch and journal
+/// of update(), and finish an update that a power loss interrupted; call it after initialize()
+/// Returns false if the last journal record is still pending but its scratch copy is incomplete (the power
+/// went before the target was touched, so it still holds the old data) or addr is not usable.
+bool SPIFlash::setUpdateScratch(uint32_t addr) {
+  SPIFLASH_LOCK();
+  if ((addr & 0xFFF) || !inRange(addr, 0x2000)) return false;
+  _updateScratch = addr;
+  uint32_t last;
+  uint8_t record[SPIFLASH_UPDATE_RECORD];
+  journalSlot(last);
+  if (last == SPIFLASH_NOPAGE) return true;
+  if (!readArray(last, record, SPIFLASH_UPDATE_RECORD)) return false;
+  if (record[12] != 0xFF) return true;  // done
+  uint32_t magic = 0, target = 0, crc = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    magic |= (uint32_t) record[i] << (8 * i);
+    target |= (uint32_t) record[4 + i] << (8 * i);
+    crc |= (uint32_t) record[8 + i] << (8 * i);
+  }
+  bool valid = magic == SPIFLASH_UPDATE_MAGIC && !(target & 0xFFF) && inRange(target, 0x1000) &&
+               crc32Update(crc32(addr, 0x1000), record + 4, 4) == crc;
+  if (valid) {
+    uint8_t page[256];
+    if (!copySector(addr, target, page)) return false;  // still pending, retried next time
+  }
+  uint8_t done = 0;
+  programBytes(last + 12, &done, 1);
+  if (_rcache) invalidateLines(last + 12, 1);
+  return valid;
+}
+
+/// Put flash memory chip into power down mode (after flushing the write cache and waiting for the last program/erase)
 /// WARNING: after this command, only the WAKEUP and DEVICE_ID commands are recognized
-/// hence a wakeup() command should be invoked first before further operations
-/// If a MCU soft restart is possible with flash chip left in sleep(), then a wakeup() command
-///   should always be invoked before any other commands to ensure the flash chip was not left in sleep
+/// The next command of this instance wakes the chip first (see powerUp()), other code talking to the chip
+/// directly has to call wakeup() first.
 void SPIFlash::sleep() {
-  command(SPIFLASH_SLEEP);
+  SPIFLASH_LOCK();
+  if (_asleep) return;
+  flush();
+  if (!command(SPIFLASH_SLEEP)) return;
   unselect();
+  _asleep = true;
+  SPIFLASH_STAT(_sleepStart = millis());
 }
 
-/// Wake flash memory from power down mode
-/// NOTE: this command is required after a sleep() command is used, or no other commands will be recognized
-/// If a MCU soft restart is possible with flash chip left in sleep(), then a wakeup() command
-///   should always be invoked before any other commands to ensure the flash chip was not left in sleep
+/// Wake flash memory from power down mode, does nothing when it is known to be awake
+/// The chip is assumed asleep until the first command after construction, since an MCU soft restart
+/// may have left it in sleep()
 void SPIFlash::wakeup() {
-  command(SPIFLASH_WAKE);
+  SPIFLASH_LOCK();
+  if (_asleep) powerUp();
+}
+
+/// true while the chip is in deep power down (or before the first command)
+bool SPIFlash::isAsleep() {
+  return _asleep;
+}
+
+/// put the chip in deep power down once it has been idle for idleMs, 0 (the default) disables it
+/// The check runs in service(), so call that from loop() or use startWorker(); the chip wakes up
+/// again on the next command. Mind that sleep() flushes the write cache.
+void SPIFlash::setAutoSleep(uint32_t idleMs) {
+  SPIFLASH_LOCK();
+  _autoSleepMs = idleMs;
+  _lastUse = millis();
+}
+
+/// release the chip from deep power down and hold off the next command for tRES1
+void SPIFlash::powerUp() {
+  _asleep = false;
+  select();
+  transfer(SPIFLASH_WAKE);
   unselect();
+  delayMicroseconds(_info.wakeLatencyUs);
+#ifdef SPIFLASH_ENABLE_STATS
+  _stats.wakeups++;
+  _stats.asleepMs += millis() - _sleepStart;
+#endif
+}
+
+/// sleep() once the queue is empty and nothing touched the chip for the setAutoSleep() time
+void SPIFlash::autoSleep() {
+  if (!_autoSleepMs || _asleep || _suspendedCmd || millis() - _lastUse < _autoSleepMs) return;
+  if (_waitCmd && busy()) return;  // the chip ignores power down while busy, try again after another idle period
+  sleep();
 }
 
 /// cleanup
 void SPIFlash::end() {
-  _spi->end();
+  SPIFLASH_LOCK();
+  flush();
+  if (_bus) _bus->end();
+  else _spi->end();
 }
\ No newline at end of file
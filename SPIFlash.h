@@ -81,47 +81,459 @@
 
 #define SPIFLASH_SLEEP            0xB9        // deep power down
 #define SPIFLASH_WAKE             0xAB        // deep power wake up
+#define SPIFLASH_TRES1_US         3           // wake up to the next command (W25X40CL, W25Q), SFDP DW14 overrides it
 #define SPIFLASH_BYTEPAGEPROGRAM  0x02        // write (1 to 256bytes)
 #define SPIFLASH_IDREAD           0x9F        // read JEDEC manufacturer and device ID (2 bytes, specific bytes for each manufacturer and device)
                                               // Example for Atmel-Adesto 4Mbit AT25DF041A: 0x1F44 (page 27: http://www.adestotech.com/sites/default/files/datasheets/doc3668.pdf)
                                               // Example for Winbond 4Mbit W25X40CL: 0xEF30 (page 14: http://www.winbond.com/NR/rdonlyres/6E25084C-0BFE-4B25-903D-AE10221A0929/0/W25X40CL.pdf)
 #define SPIFLASH_MACREAD          0x4B        // read unique ID number (MAC)
-                                              
+#define SPIFLASH_SFDPREAD         0x5A        // read Serial Flash Discoverable Parameters (JESD216), 3 address bytes + 1 dummy byte
+
+/// Security registers: small OTP pages beside the main array (Winbond W25Q, GigaDevice, ...), register n (1..3) is
+/// addressed as n << 12 | offset. They erase and program like a sector until lockSecurityRegister() sets its
+/// lock bit (LB1..LB3 in status register 2), after which they are read-only for good.
+#define SPIFLASH_SECREGREAD       0x48        // read security register, address + 1 dummy byte
+#define SPIFLASH_SECREGPROGRAM    0x42        // program security register (clears bits, like a page program)
+#define SPIFLASH_SECREGERASE      0x44        // erase security register
+#define SPIFLASH_SECREGCOUNT      3
+#define SPIFLASH_SECREGSIZE       256         // bytes per register on the W25Q, some parts have more
+
+/// 4-byte addressing for chips larger than 16MB (128Mbit)
+/// Chips with the dedicated 4-byte instruction set stay in 3-byte mode and get these opcodes instead,
+/// others are switched to 4-byte address mode with SPIFLASH_ENTER4BYTE
+#define SPIFLASH_ENTER4BYTE       0xB7        // enter 4-byte address mode
+#define SPIFLASH_ARRAYREAD4B      0x0C        // fast read, 4 address bytes + 1 dummy byte
+#define SPIFLASH_ARRAYREADLOWFREQ4B 0x13      // read, 4 address bytes
+#define SPIFLASH_BYTEPAGEPROGRAM4B 0x12       // page program, 4 address bytes
+#define SPIFLASH_BLOCKERASE_4K4B  0x21
+#define SPIFLASH_BLOCKERASE_32K4B 0x5C
+#define SPIFLASH_BLOCKERASE_64K4B 0xDC
+
+/// Dual/quad SPI, only reachable through a board-specific SPIFlashMultiIO transport (see setMultiIO())
+#define SPIFLASH_STATUS2READ      0x35        // read status register 2 (QE bit 1 on Winbond/GigaDevice)
+#define SPIFLASH_STATUS2WRITE     0x31        // write status register 2
+#define SPIFLASH_QUADPAGEPROGRAM  0x32        // page program, data on 4 lanes (1-1-4)
+#define SPIFLASH_QUADPAGEPROGRAM4B 0x34       // same with 4 address bytes
+#define SPIFLASH_ERASESUSPEND     0x75        // suspend a sector/block erase (Winbond, GigaDevice; Macronix uses 0xB0)
+#define SPIFLASH_ERASERESUME      0x7A        // resume it (Macronix uses 0x30)
+#define SPIFLASH_TSUS_US          20          // suspend latency
+#define SPIFLASH_TRS_US           100         // time an erase is left running between a resume and the next suspend
+
+/// Chip descriptor filled by initialize() from the JEDEC ID and the SFDP tables (see readChipInfo())
+/// Chips without SFDP keep the defaults: 256 byte pages, 3 byte addresses, 4K/32K/64K erases with the opcodes above
+#define SPIFLASH_ERASETYPES       4           // SFDP describes up to 4 erase granularities
+#define SPIFLASH_READ_112         0x01        // fast read modes (instruction-address-data lanes)
+#define SPIFLASH_READ_122         0x02
+#define SPIFLASH_READ_114         0x04
+#define SPIFLASH_READ_144         0x08
+#define SPIFLASH_READMODES        4           // readOpcode/readDummy index is the bit number of SPIFLASH_READ_*
+
+struct SPIFlashInfo {
+  uint32_t jedecID;                             // manufacturer, memory type, capacity bytes
+  uint32_t capacity;                            // bytes, 0 if unknown
+  uint16_t pageSize;
+  uint8_t addressBytes;                         // 3 or 4
+  uint8_t readModes;                            // SPIFLASH_READ_* supported besides single lane 0x0B
+  uint8_t readOpcode[SPIFLASH_READMODES];       // ie. 0x3B, 0xBB, 0x6B, 0xEB
+  uint8_t readDummy[SPIFLASH_READMODES];        // dummy clocks, including mode clocks
+  uint8_t quadEnable;                           // SFDP QER field: how to set the QE bit for quad modes
+  uint8_t eraseSizeLog2[SPIFLASH_ERASETYPES];   // ie. 12 for 4K, 0 for an unused slot
+  uint8_t eraseOpcode[SPIFLASH_ERASETYPES];
+  uint8_t suspendOpcode;                        // erase suspend, 0 if the chip cannot suspend an erase
+  uint8_t resumeOpcode;                         // erase resume
+  uint16_t suspendLatencyUs;                    // max time until a suspend takes effect
+  uint16_t resumeIntervalUs;                    // min time between a resume and the next suspend
+  uint16_t wakeLatencyUs;                       // deep power down exit (tRES1) to the next command
+  bool sfdp;                                    // true when the descriptor came from a valid SFDP table
+};
+
+/// Multi-lane transport for boards whose SPI/QSPI peripheral can drive IO2/IO3 (ie. ESP32 spi_master
+/// with SPI_TRANS_MODE_QIO, RP2040 PIO, STM32 QUADSPI). The plain Arduino SPIClass is single lane only,
+/// so this is the hook for the board code; without one readBytes stays on single lane 0x0B.
+/// The transport owns chip select for the whole command. Mode clocks are counted in dummyClocks and
+/// must be driven as 0x00 (never 0xAx, which would enter continuous read mode).
+class SPIFlashMultiIO {
+public:
+  virtual uint8_t lanes() = 0;  // data lanes wired to the flash: 2 or 4
+  virtual void read(uint8_t opcode, uint32_t addr, uint8_t addrBytes, uint8_t addrLanes, uint8_t dummyClocks, uint8_t dataLanes, void* buf, uint16_t len) = 0;
+  virtual void program(uint8_t opcode, uint32_t addr, uint8_t addrBytes, uint8_t dataLanes, const void* buf, uint16_t len) = 0;
+};
+
+/// Typical program/erase times used to pace status polling after a write-class command (see waitReady())
+/// Defaults fit the small Winbond/Adesto parts used on Moteinos; use setTiming() for other chips.
+/// The hard timeout for each operation is its typical time * maxMultiplier.
+#define SPIFLASH_TPP_US           700         // page program
+#define SPIFLASH_TW_MS            10          // write status register
+#define SPIFLASH_TSE_MS           45          // 4K sector erase
+#define SPIFLASH_TBE32_MS         120         // 32K block erase
+#define SPIFLASH_TBE64_MS         150         // 64K block erase
+#define SPIFLASH_TCE_MS           1000        // chip erase
+#define SPIFLASH_TMAX_MULTIPLIER  8
+#define SPIFLASH_POLL_MIN_US      8           // backoff range for status polling once the typical time has passed
+#define SPIFLASH_POLL_MAX_US      10000
+
+#define SPIFLASH_ERR_NONE         0
+#define SPIFLASH_ERR_TIMEOUT      1           // chip stayed busy past the hard timeout (no chip, sleeping chip or floating MISO)
+#define SPIFLASH_ERR_RANGE        2           // address range beyond the chip capacity, nothing was sent
+#define SPIFLASH_ERR_QUEUEFULL    3           // operation queue full, nothing was queued (retry after service())
+
+struct SPIFlashTiming {
+  uint16_t pageProgramUs;
+  uint16_t statusWriteMs;
+  uint16_t erase4KMs;
+  uint16_t erase32KMs;
+  uint16_t erase64KMs;
+  uint32_t chipEraseMs;
+  uint8_t maxMultiplier;
+};
+
+/// Optional write-back page cache, see setWriteCache()
+/// Small writes into the same page are merged in RAM and programmed with one page program when the page
+/// fills, when the slot is needed for another page, on flush(), sleep() or end(). A slot holds one chip
+/// page (chipInfo().pageSize), or a 256 byte part of it on chips with larger pages.
+#define SPIFLASH_NOPAGE           0xFFFFFFFF  // unused cache slot
+
+struct SPIFlashCachePage {
+  uint32_t addr;      // page address, SPIFLASH_NOPAGE when the slot is free
+  uint16_t stamp;     // last use, for LRU eviction
+  uint8_t lo, hi;     // dirty range inside the page (inclusive)
+  uint8_t data[256];
+};
+
+/// Optional read cache, see setReadCache()
+/// readByte and readBytes calls no longer than a line are served from RAM lines (LRU), a miss right
+/// after the previously fetched line also fetches the following line in the same transaction (read-ahead)
+struct SPIFlashCacheLine {
+  uint32_t addr;      // line address, SPIFLASH_NOPAGE when the line is empty
+  uint16_t stamp;     // last use, for LRU eviction
+};
+
+/// Block transfers for the data phase of readBytes/writeBytes
+/// Cores that have the SPI transaction API also have the in-place transfer(buf, len), which streams
+/// the payload without per-byte call overhead. ESP cores additionally have a transmit-only writeBytes(),
+/// STM32 can skip the receive phase. Anything older falls back to one transfer() per byte.
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+  #define SPIFLASH_HAS_WRITEBYTES
+#elif defined(ARDUINO_ARCH_STM32)
+  #define SPIFLASH_HAS_TRANSMITONLY
+#elif !defined(SPI_HAS_TRANSACTION)
+  #define SPIFLASH_BYTE_TRANSFER
+#endif
+#define SPIFLASH_TXCHUNK          32          // stack bounce buffer for writes on cores that only have in-place transfer(buf, len)
+#define SPIFLASH_READCHUNK        0x8000      // largest piece of a readBytes data phase handed to the SPI core at once
+
+/// Asynchronous data phase (readBytesAsync/writePageAsync)
+/// Define SPIFLASH_USE_DMA (ie. in build flags) on cores whose SPIClass has a non-blocking DMA
+/// transfer(txbuf, rxbuf, len, block) plus isBusy(), such as the Adafruit SAMD21/SAMD51 core.
+/// Everywhere else the async calls run the data phase with the blocking block transfer and complete immediately.
+#if defined(SPIFLASH_USE_DMA) && !defined(ARDUINO_ARCH_SAMD)
+  #undef SPIFLASH_USE_DMA
+#endif
+
+/// Completion callback for the async calls, runs from asyncDone() (never from an interrupt)
+typedef void (*SPIFlashCallback)(void* context);
+
+/// Data source for writeStream(): fill buf with up to len bytes, return how many were written
+typedef uint16_t (*SPIFlashSource)(uint8_t* buf, uint16_t len, void* context);
+/// Data sink for readStream(): consume the len bytes in buf, return false to end the stream
+typedef bool (*SPIFlashSink)(const uint8_t* buf, uint16_t len, void* context);
+#ifndef SPIFLASH_STREAMCHUNK
+  #define SPIFLASH_STREAMCHUNK    256         // stack staging buffer of writeStream/readStream, one page
+#endif
+
+/// FreeRTOS support
+/// Define SPIFLASH_RTOS (in build flags, it has to reach SPIFlash.cpp) to make SPIFlash safe to share between tasks:
+/// - every public call holds a recursive mutex of its SPIFlash instance, so calls from several tasks no longer
+///   interleave their command streams; lock()/unlock() extend that over a sequence of calls (ie. raw command())
+/// - SPIFlash instances (and layers on top of them) that are driven through the same SPIClass also share a bus
+///   lock held from select() to unselect(), so two chips on one bus cannot talk at the same time; it is a binary
+///   semaphore because an async transfer started by one task may be finished by asyncDone() in another
+/// - startWorker() runs service() from a dedicated task, which other tasks feed through the queue calls
+///   (queueReadBytes, queueWriteBytes, queueBlockErase4K, ...) and waitOp()
+/// Without it lock()/unlock() do nothing and the queue is advanced by calling service() as before.
+#ifdef SPIFLASH_RTOS
+  #if defined(ARDUINO_ARCH_ESP32) || defined(ESP_PLATFORM)
+    #include <freertos/FreeRTOS.h>
+    #include <freertos/semphr.h>
+    #include <freertos/task.h>
+  #else
+    #include <FreeRTOS.h>
+    #include <semphr.h>
+    #include <task.h>
+  #endif
+  #define SPIFLASH_WORKER_STACK   2048
+  #define SPIFLASH_WORKER_PRIO    2
+  #define SPIFLASH_RTOS_BUSES     4           // SPIClass buses with their own bus lock, more share the last one
+#endif
+
+/// Optional instrumentation, see getStats()
+/// Define SPIFLASH_ENABLE_STATS in the build flags (it has to reach SPIFlash.cpp, a #define in the sketch
+/// does not) to count traffic and time the waits inside SPIFlash. Compiled out it costs nothing,
+/// getStats()/resetStats() and the counters do not exist then.
+#ifdef SPIFLASH_ENABLE_STATS
+struct SPIFlashStats {
+  uint32_t bytesRead;         // data bytes clocked in from the array (cache hits not included)
+  uint32_t bytesWritten;      // data bytes clocked out to page programs
+  uint32_t pagePrograms;
+  uint32_t erases4K;
+  uint32_t erases32K;
+  uint32_t erases64K;
+  uint32_t chipErases;
+  uint32_t busyPolls;         // status reads through busy(), plus each byte of continuous polling
+  uint32_t waits;             // waitReady() calls, ie. the wait in front of every command
+  uint32_t waitUs;            // total time spent in waitReady()
+  uint32_t waitMaxUs;
+  uint32_t transactions;      // select()/unselect() pairs
+  uint32_t transactionUs;     // total time spent in select() + unselect() (beginTransaction, chip select)
+  uint32_t transactionMaxUs;
+  uint32_t wakeups;           // deep power down exits, explicit or automatic
+  uint32_t asleepMs;          // time spent in deep power down, counted at each wake up
+};
+#endif
+
+/// Delta writes, see update()
+/// A sector that needs an erase is first rebuilt in a scratch sector, then a journal record (in the sector
+/// after it) names the target and the CRC of the rebuilt copy before the target is erased and rewritten, so
+/// setUpdateScratch() at the next boot can finish an update cut by a power loss.
+#define SPIFLASH_UPDATE_MAGIC     0x4A554653  // "SFUJ", journal record
+#define SPIFLASH_UPDATE_RECORD    16          // magic, target, CRC-32 of scratch + target, state, 3 spare bytes
+#define SPIFLASH_UPDATE_SAME      0           // update() plan of a sector: nothing to do
+#define SPIFLASH_UPDATE_PROGRAM   1           // only clears bits, programmed in place
+#define SPIFLASH_UPDATE_ERASE     2           // needs the erase + rewrite through the scratch sector
+#define SPIFLASH_UPDATE_FAILED    3           // the sector could not be read (chip timed out)
+
+/// Non-blocking erase/program queue, see queueBlockErase4K() and friends
+/// queue calls return a token (0 means the queue was full), service() advances the queue from the main loop
+#define SPIFLASH_OPQUEUE_SIZE     4           // pending erase/program operations per SPIFlash instance
+#define SPIFLASH_OP_DONE          0           // finished (or an old token that already left the queue)
+#define SPIFLASH_OP_QUEUED        1           // waiting for the chip
+#define SPIFLASH_OP_RUNNING       2           // issued, chip is busy with it
+/// queued reads (op.cmd SPIFLASH_ARRAYREAD) run ahead of earlier writes and erases they do not overlap
+
+struct SPIFlashOp {
+  uint8_t token;
+  uint8_t state;
+  uint8_t cmd;
+  uint32_t addr;
+  const uint8_t* buf;
+  uint16_t len;
+};
+
+/// One step of runBatch()
+/// cmd is SPIFLASH_ARRAYREAD (len bytes into buf), SPIFLASH_BYTEPAGEPROGRAM (len bytes from buf, as writeBytes),
+/// an erase opcode (SPIFLASH_BLOCKERASE_4K/32K/64K, SPIFLASH_CHIPERASE) or SPIFLASH_STATUSREAD (status into buf[0])
+struct SPIFlashBatchOp {
+  uint8_t cmd;
+  uint32_t addr;
+  void* buf;
+  uint16_t len;
+};
+
+/// Transport for a chip that is not driven through an Arduino SPIClass and a chip select pin
+/// (host simulation, bit-banged or vendor SPI drivers), see SPIFlash(SPIFlashBus*, jedecID)
+/// select() starts a transaction and asserts chip select, unselect() releases both.
+/// read/write move a data phase, override them when the transport has a faster block transfer.
+class SPIFlashBus {
+public:
+  virtual void begin() {}
+  virtual void end() {}
+  virtual void select() = 0;
+  virtual void unselect() = 0;
+  virtual uint8_t transfer(uint8_t data) = 0;
+  virtual void read(void* buf, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) ((uint8_t*) buf)[i] = transfer(0);
+  }
+  virtual void write(const void* buf, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) transfer(((const uint8_t*) buf)[i]);
+  }
+};
+
 class SPIFlash {
 public:
-  static uint8_t UNIQUEID[8];
+  uint8_t UNIQUEID[8];
   SPIFlash(uint8_t slaveSelectPin, SPIClass *_spi, SPISettings settings, uint16_t jedecID=0);
+  SPIFlash(SPIFlashBus* bus, uint16_t jedecID=0);
   bool initialize();
-  void command(uint8_t cmd, bool isWrite=false);
+  bool command(uint8_t cmd, bool isWrite=false);
   uint8_t readStatus();
   uint8_t readByte(uint32_t addr);
-  void readBytes(uint32_t addr, void* buf, uint16_t len);
+  void readBytes(uint32_t addr, void* buf, uint32_t len);
   void writeByte(uint32_t addr, uint8_t byt);
-  void writeBytes(uint32_t addr, const void* buf, uint16_t len);
+  void writeBytes(uint32_t addr, const void* buf, uint32_t len);
+  void writeBytes(uint32_t addr, const void* prefix, uint16_t prefixLen, const void* buf, uint32_t len);
+  uint32_t writeStream(uint32_t addr, uint32_t len, SPIFlashSource source, void* context=NULL, bool erase=false);
+  uint32_t writeStream(uint32_t addr, uint32_t len, Stream& in, bool erase=false);
+  uint32_t readStream(uint32_t addr, uint32_t len, SPIFlashSink sink, void* context=NULL);
+  uint32_t readStream(uint32_t addr, uint32_t len, Print& out);
   bool busy();
+  bool waitReady();
+  void setTiming(const SPIFlashTiming& timing);
+  void setContinuousPolling(bool enable);
+  void setReadSuspend(bool enable);
+  void setProgramSuspend(bool enable);
+  uint8_t lastError();
   void chipErase();
   void blockErase4K(uint32_t address);
   void blockErase32K(uint32_t address);
   void blockErase64K(uint32_t addr);
+  bool eraseRange(uint32_t addr, uint32_t len, bool skipBlank=false);
   uint16_t readDeviceId();
+  uint32_t readJedecId();
+  void readSFDP(uint32_t addr, void* buf, uint16_t len);
+  bool readChipInfo();
+  const SPIFlashInfo& chipInfo();
+  uint8_t setMultiIO(SPIFlashMultiIO* io, bool quadProgram=false);
   uint8_t* readUniqueId();
   uint8_t found();
+  bool readSecurityRegister(uint8_t reg, uint16_t offset, void* buf, uint16_t len);
+  bool programSecurityRegister(uint8_t reg, uint16_t offset, const void* buf, uint16_t len);
+  bool eraseSecurityRegister(uint8_t reg);
+  bool lockSecurityRegister(uint8_t reg);
+  bool isSecurityRegisterLocked(uint8_t reg);
   uint8_t regionIsEmpty(uint32_t startAddress, uint8_t length);
+  bool isBlank(uint32_t addr, uint32_t len, uint32_t* firstDirty=NULL);
+  uint32_t crc32(uint32_t addr, uint32_t len, uint32_t crc=0);
+  static uint32_t crc32Update(uint32_t crc, const void* buf, uint16_t len);
+  bool compare(uint32_t addr, const void* buf, uint32_t len);
+  bool writeVerify(uint32_t addr, const void* buf, uint32_t len);
+  bool update(uint32_t addr, const void* buf, uint32_t len);
+  bool setUpdateScratch(uint32_t addr);
+  uint32_t updateScratch();
+  bool readBytesAsync(uint32_t addr, void* buf, uint16_t len, SPIFlashCallback callback=NULL, void* context=NULL);
+  bool writePageAsync(uint32_t addr, const void* buf, uint16_t len, SPIFlashCallback callback=NULL, void* context=NULL);
+  bool asyncDone();
+  uint8_t queueChipErase();
+  uint8_t queueBlockErase4K(uint32_t addr);
+  uint8_t queueBlockErase32K(uint32_t addr);
+  uint8_t queueBlockErase64K(uint32_t addr);
+  uint8_t queueWriteBytes(uint32_t addr, const void* buf, uint16_t len);
+  uint8_t queueReadBytes(uint32_t addr, void* buf, uint16_t len);
+  uint8_t opStatus(uint8_t token);
+  void waitOp(uint8_t token);
+  bool service();
+  bool isIdle();
+  bool runBatch(SPIFlashBatchOp* ops, uint8_t count);
+  void lock();
+  void unlock();
+#ifdef SPIFLASH_RTOS
+  bool startWorker(UBaseType_t priority=SPIFLASH_WORKER_PRIO, uint32_t stackSize=SPIFLASH_WORKER_STACK);
+  void stopWorker();
+#endif
+  void setWriteCache(SPIFlashCachePage* pages, uint8_t count);
+  void flush();
+  void setReadCache(SPIFlashCacheLine* lines, uint8_t count, uint8_t* data, uint16_t lineSize);
+#ifdef SPIFLASH_ENABLE_STATS
+  const SPIFlashStats& getStats();
+  void resetStats();
+#endif
 
   void sleep();
   void wakeup();
+  bool isAsleep();
+  void setAutoSleep(uint32_t idleMs);
   void end();
 protected:
   void select();
   void unselect();
+  void powerUp();
+  void autoSleep();
+  void holdBus();
+  void releaseBus();
+  uint8_t transfer(uint8_t data) { return _bus ? _bus->transfer(data) : _spi->transfer(data); }
+  void sendAddress(uint32_t addr);
+  bool securityCommand(uint8_t cmd, uint8_t reg, uint16_t offset, uint16_t len);
+  bool inRange(uint32_t addr, uint32_t len);
+  bool enableQuad();
+  bool suspendErase(uint32_t addr=SPIFLASH_NOPAGE, uint32_t len=0);
+  void resumeErase();
+  bool readArray(uint32_t addr, void* buf, uint32_t len);
+  void readPayload(void* buf, uint16_t len);
+  void writePayload(const void* buf, uint16_t len);
+  uint8_t queueOp(uint8_t cmd, uint32_t addr, const void* buf, uint16_t len);
+  void startOp(SPIFlashOp& op);
+  void serviceReads();
+  void expectedTime(uint8_t cmd, uint32_t& typUs, uint32_t& maxUs);
+  bool programPage(uint32_t addr, const void* buf, uint16_t len, const void* more=NULL, uint16_t moreLen=0);
+  bool programBytes(uint32_t addr, const uint8_t* buf, uint32_t len, const uint8_t* prefix=NULL, uint16_t prefixLen=0);
+  void eraseBlock(uint32_t addr, uint8_t sizeLog2);
+  uint8_t planUpdate(uint32_t addr, const uint8_t* buf, uint16_t len, uint8_t* dirtyLo, uint8_t* dirtyHi);
+  bool rewriteSector(uint32_t sector, uint32_t addr, const uint8_t* buf, uint16_t len);
+  bool copySector(uint32_t from, uint32_t to, uint8_t* page);
+  uint32_t journalSlot(uint32_t& last);
+  uint8_t eraseOpcode(uint8_t sizeLog2);
+  uint8_t eraseSizeLog2(uint8_t opcode);
+  uint16_t cachePageSize();
+  void cacheWrite(uint32_t addr, const uint8_t* buf, uint32_t len);
+  void flushPage(SPIFlashCachePage& page);
+  void flushRange(uint32_t addr, uint32_t len);
+  void discardRange(uint32_t addr, uint32_t len);
+  void cacheRead(uint32_t addr, uint8_t* buf, uint16_t len);
+  SPIFlashCacheLine* fillLine(uint32_t lineAddr);
+  void invalidateLines(uint32_t addr, uint32_t len);
   uint8_t _slaveSelectPin;
   uint16_t _jedecID;
   SPIClass *_spi;
+  SPIFlashBus* _bus;          // replaces _spi and the chip select pin when set
   uint8_t _SPCR;
   uint8_t _SPSR;
+#if defined(__AVR__)
+  volatile uint8_t* _csPort;  // chip select through the port register, see select()
+  uint8_t _csMask;
+#endif
+  bool _busHeld;              // runBatch() holds the SPI transaction, select()/unselect() only toggle chip select
+  bool _asyncActive;
+  SPIFlashCallback _asyncCallback;
+  void* _asyncContext;
+  SPIFlashOp _ops[SPIFLASH_OPQUEUE_SIZE];
+  uint8_t _opHead;
+  uint8_t _opCount;
+  uint8_t _opLastToken;
+  SPIFlashInfo _info;
+  bool _uniqueIdValid;        // UNIQUEID holds the chip's ID, read at initialize()
+  bool _addr4Opcodes;
+  SPIFlashMultiIO* _multiIO;
+  uint8_t _readMode;
+  bool _quadProgram;
+  SPIFlashTiming _timing;
+  uint8_t _waitCmd;
+  uint32_t _waitStart;
+  uint32_t _waitAddr;         // block address of the erase in _waitCmd
+  bool _continuousPolling;
+  bool _readSuspend;
+  bool _programSuspend;
+  uint8_t _suspendedCmd;
+  uint32_t _suspendStart;
+  uint32_t _resumeTime;
+  uint8_t _lastError;
+  SPIFlashCachePage* _wcache;
+  uint8_t _wcacheCount;
+  uint16_t _wcacheTick;
+  SPIFlashCacheLine* _rcache;
+  uint8_t _rcacheCount;
+  uint8_t* _rcacheData;
+  uint16_t _rcacheLineSize;
+#ifdef SPIFLASH_ENABLE_STATS
+  SPIFlashStats _stats;
+  uint32_t _selectUs;         // time select() took, added to the transaction time by unselect()
+  uint32_t _sleepStart;       // millis() when the chip entered deep power down
+#endif
+  uint16_t _rcacheTick;
+  uint32_t _rcacheNext;
+  uint32_t _updateScratch;    // scratch + journal sectors of update(), SPIFLASH_NOPAGE when not set
+  bool _asleep;               // in deep power down (or not known to be awake yet), the next select() wakes it
+  uint32_t _autoSleepMs;      // idle time before service() puts the chip to sleep, 0 = never
+  uint32_t _lastUse;          // millis() at the end of the last transaction, kept while _autoSleepMs is set
 #ifdef SPI_HAS_TRANSACTION
   SPISettings _settings;
 #endif
+#ifdef SPIFLASH_RTOS
+  static void workerTask(void* self);
+  SemaphoreHandle_t _mutex;
+  TaskHandle_t _worker;
+  bool _workerStop;           // set by stopWorker() under _mutex, read there by the worker
+  SemaphoreHandle_t _workerDone;  // given by the worker as its last act before deleting itself
+  SemaphoreHandle_t _busLock;  // shared by all instances on the same SPIClass, NULL with a SPIFlashBus
+#endif
 };
 
 #endif
\ No newline at end of file
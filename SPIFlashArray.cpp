@@ -0,0 +1,224 @@
+// Several SPIFlash chips behind one address space
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashArray.h>
+
+/// Constructor. chips points to count SPIFlash objects, which must outlive the array
+SPIFlashArray::SPIFlashArray(SPIFlash** chips, uint8_t count, uint8_t mode) {
+  _chips = chips;
+  _count = count;
+  _mode = mode;
+  _capacity = 0;
+}
+
+/// initialize every chip, returns false if one is not found or its capacity is unknown
+bool SPIFlashArray::initialize() {
+  uint32_t smallest = 0xFFFFFFFF;
+  _capacity = 0;
+  if (!_count) return false;
+  for (uint8_t i = 0; i < _count; i++) {
+    if (!_chips[i]->initialize()) return false;
+    uint32_t size = _chips[i]->chipInfo().capacity;
+    if (!size) return false;
+    if (size < smallest) smallest = size;
+    _capacity += size;
+  }
+  if (_mode == SPIFLASHARRAY_STRIPE) _capacity = smallest * _count;
+  return true;
+}
+
+/// total bytes addressable through the array
+uint32_t SPIFlashArray::capacity() {
+  return _capacity;
+}
+
+uint8_t SPIFlashArray::chipCount() {
+  return _count;
+}
+
+SPIFlash& SPIFlashArray::chip(uint8_t index) {
+  return *_chips[index];
+}
+
+uint8_t SPIFlashArray::readByte(uint32_t addr) {
+  uint32_t chipAddr, run;
+  if (addr >= _capacity) return 0xFF;
+  return _chips[locate(addr, chipAddr, run)]->readByte(chipAddr);
+}
+
+void SPIFlashArray::readBytes(uint32_t addr, void* buf, uint32_t len) {
+  if (addr >= _capacity || len > _capacity - addr) return;
+  uint8_t* out = (uint8_t*) buf;
+  while (len) {
+    uint32_t chipAddr, run;
+    uint8_t i = locate(addr, chipAddr, run);
+    uint32_t n = len < run ? len : run;
+    _chips[i]->readBytes(chipAddr, out, n);
+    addr += n;
+    out += n;
+    len -= n;
+  }
+}
+
+void SPIFlashArray::writeByte(uint32_t addr, uint8_t byt) {
+  writeBytes(addr, &byt, 1);
+}
+
+/// When striping, each page program goes to the next chip and only waits for that chip's previous page
+void SPIFlashArray::writeBytes(uint32_t addr, const void* buf, uint32_t len) {
+  if (addr >= _capacity || len > _capacity - addr) return;
+  const uint8_t* in = (const uint8_t*) buf;
+  while (len) {
+    uint32_t chipAddr, run;
+    uint8_t i = locate(addr, chipAddr, run);
+    uint32_t n = len < run ? len : run;
+    _chips[i]->writeBytes(chipAddr, in, n);
+    addr += n;
+    in += n;
+    len -= n;
+  }
+}
+
+/// pipelined bulk write, see SPIFlash::writeStream()
+/// When striping, source fills the next stripe while the other chips are still programming theirs
+uint32_t SPIFlashArray::writeStream(uint32_t addr, uint32_t len, SPIFlashSource source, void* context) {
+  if (addr >= _capacity || len > _capacity - addr) return 0;
+  uint8_t buf[SPIFLASHARRAY_STRIPESIZE];
+  uint32_t done = 0;
+  while (len) {
+    uint32_t chipAddr, run;
+    uint8_t i = locate(addr, chipAddr, run);
+    uint16_t n = SPIFLASHARRAY_STRIPESIZE - (addr % SPIFLASHARRAY_STRIPESIZE);
+    if (n > run) n = run;
+    if (n > len) n = len;
+    uint16_t got = source(buf, n, context);
+    if (got > n) got = n;
+    if (got) _chips[i]->writeBytes(chipAddr, buf, got);
+    addr += got;
+    done += got;
+    len -= got;
+    if (got < n) break;
+  }
+  return done;
+}
+
+/// erase the 4K block holding addr (count*4K when striping)
+void SPIFlashArray::blockErase4K(uint32_t addr) {
+  eraseBlock(addr, 12);
+}
+
+/// erase the 32K block holding addr (count*32K when striping)
+void SPIFlashArray::blockErase32K(uint32_t addr) {
+  eraseBlock(addr, 15);
+}
+
+/// erase the 64K block holding addr (count*64K when striping)
+void SPIFlashArray::blockErase64K(uint32_t addr) {
+  eraseBlock(addr, 16);
+}
+
+/// erase [addr, addr+len) with the fewest block erases, see SPIFlash::eraseRange()
+/// When striping, addr and len must be multiples of count*4K and every step erases on all chips at once
+bool SPIFlashArray::eraseRange(uint32_t addr, uint32_t len) {
+  if (addr >= _capacity || len > _capacity - addr) return false;
+  if (_mode == SPIFLASHARRAY_STRIPE) {
+    uint32_t unit = 4096UL * _count;
+    if (addr % unit || len % unit) return false;
+    uint32_t start = addr / _count, end = (addr + len) / _count;
+    while (start < end) {
+      uint8_t sizeLog2 = 12;
+      if (!(start & 0xFFFF) && end - start >= 0x10000) sizeLog2 = 16;
+      else if (!(start & 0x7FFF) && end - start >= 0x8000) sizeLog2 = 15;
+      eraseBlock(start * _count, sizeLog2);
+      start += 1UL << sizeLog2;
+    }
+    return true;
+  }
+  while (len) {
+    uint32_t chipAddr, run;
+    uint8_t i = locate(addr, chipAddr, run);
+    uint32_t n = len < run ? len : run;
+    if (!_chips[i]->eraseRange(chipAddr, n)) return false;
+    addr += n;
+    len -= n;
+  }
+  return true;
+}
+
+/// erase all chips, they run in parallel
+void SPIFlashArray::chipErase() {
+  for (uint8_t i = 0; i < _count; i++) _chips[i]->chipErase();
+}
+
+/// true while any chip is busy
+bool SPIFlashArray::busy() {
+  for (uint8_t i = 0; i < _count; i++)
+    if (_chips[i]->busy()) return true;
+  return false;
+}
+
+/// wait until every chip is ready, false if one timed out
+bool SPIFlashArray::waitReady() {
+  bool ok = true;
+  for (uint8_t i = 0; i < _count; i++)
+    if (!_chips[i]->waitReady()) ok = false;
+  return ok;
+}
+
+void SPIFlashArray::flush() {
+  for (uint8_t i = 0; i < _count; i++) _chips[i]->flush();
+}
+
+void SPIFlashArray::sleep() {
+  for (uint8_t i = 0; i < _count; i++) _chips[i]->sleep();
+}
+
+void SPIFlashArray::wakeup() {
+  for (uint8_t i = 0; i < _count; i++) _chips[i]->wakeup();
+}
+
+/// chip holding addr, its address on that chip and how many bytes follow there contiguously
+uint8_t SPIFlashArray::locate(uint32_t addr, uint32_t& chipAddr, uint32_t& run) {
+  if (_mode == SPIFLASHARRAY_STRIPE) {
+    uint32_t stripe = addr / SPIFLASHARRAY_STRIPESIZE;
+    uint32_t offset = addr % SPIFLASHARRAY_STRIPESIZE;
+    chipAddr = stripe / _count * SPIFLASHARRAY_STRIPESIZE + offset;
+    run = SPIFLASHARRAY_STRIPESIZE - offset;
+    return stripe % _count;
+  }
+  uint8_t i = 0;
+  while (i < _count - 1 && addr >= _chips[i]->chipInfo().capacity) addr -= _chips[i++]->chipInfo().capacity;
+  chipAddr = addr;
+  run = _chips[i]->chipInfo().capacity - addr;
+  return i;
+}
+
+void SPIFlashArray::eraseBlock(uint32_t addr, uint8_t sizeLog2) {
+  if (addr >= _capacity) return;
+  uint32_t chipAddr, run;
+  uint8_t first = locate(addr, chipAddr, run), last = first;
+  if (_mode == SPIFLASHARRAY_STRIPE) {
+    // the logical block of count*size bytes is the same block on every chip
+    chipAddr = addr / _count;
+    first = 0;
+    last = _count - 1;
+  }
+  for (uint8_t i = first; i <= last; i++) {
+    if (sizeLog2 == 16) _chips[i]->blockErase64K(chipAddr);
+    else if (sizeLog2 == 15) _chips[i]->blockErase32K(chipAddr);
+    else _chips[i]->blockErase4K(chipAddr);
+  }
+}
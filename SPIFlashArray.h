@@ -0,0 +1,65 @@
+// Several SPIFlash chips behind one address space
+// **********************************************************************************
+// SPIFLASHARRAY_CONCAT puts the chips one after the other.
+// SPIFLASHARRAY_STRIPE interleaves them by 256 byte page (RAID-0): page n is on chip n % count, so a long
+// writeBytes programs a page on one chip while the previous ones are still busy with theirs, and an erase
+// runs on all chips at once. Striped erases cover count times the block size (ie. blockErase4K erases a
+// count*4K logical block) and the capacity is count times the smallest chip.
+// Each chip keeps its own SPIFlash object, chip select and SPIClass bus.
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHARRAY_H_
+#define _SPIFLASHARRAY_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHARRAY_CONCAT      0
+#define SPIFLASHARRAY_STRIPE      1
+#define SPIFLASHARRAY_STRIPESIZE  256         // bytes per chip before moving to the next one when striping
+
+class SPIFlashArray {
+public:
+  SPIFlashArray(SPIFlash** chips, uint8_t count, uint8_t mode=SPIFLASHARRAY_CONCAT);
+  bool initialize();
+  uint32_t capacity();
+  uint8_t chipCount();
+  SPIFlash& chip(uint8_t index);
+  uint8_t readByte(uint32_t addr);
+  void readBytes(uint32_t addr, void* buf, uint32_t len);
+  void writeByte(uint32_t addr, uint8_t byt);
+  void writeBytes(uint32_t addr, const void* buf, uint32_t len);
+  uint32_t writeStream(uint32_t addr, uint32_t len, SPIFlashSource source, void* context=NULL);
+  void blockErase4K(uint32_t addr);
+  void blockErase32K(uint32_t addr);
+  void blockErase64K(uint32_t addr);
+  bool eraseRange(uint32_t addr, uint32_t len);
+  void chipErase();
+  bool busy();
+  bool waitReady();
+  void flush();
+  void sleep();
+  void wakeup();
+protected:
+  uint8_t locate(uint32_t addr, uint32_t& chipAddr, uint32_t& run);
+  void eraseBlock(uint32_t addr, uint8_t sizeLog2);
+
+  SPIFlash** _chips;
+  uint8_t _count;
+  uint8_t _mode;
+  uint32_t _capacity;
+};
+
+#endif
@@ -0,0 +1,188 @@
+// Block device adapter for filesystems on top of SPIFlash (littlefs, SdFat/FatFs style sector I/O)
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashBlockDevice.h>
+
+/// Constructor. The device covers size bytes from startAddress (0 = up to the end of the chip), both
+/// multiples of the erase size. eraseBuffer (eraseSize() bytes, usually 4K) is optional, see the header.
+/// Call begin() after flash.initialize()
+SPIFlashBlockDevice::SPIFlashBlockDevice(SPIFlash& flash, uint32_t startAddress, uint32_t size, uint8_t* eraseBuffer) : _flash(flash) {
+  _start = startAddress;
+  _size = size;
+  _eraseLog2 = 12;
+  _pageSize = 256;
+  _buffer = eraseBuffer;
+  _bufferBlock = SPIFLASH_NOPAGE;
+  _bufferDirty = false;
+}
+
+/// take the erase and page size from flash.chipInfo()
+/// Returns false if the area is not made of whole erase blocks or does not fit in the chip, or if there is
+/// no eraseBuffer and flash has no update scratch outside the area (see the header)
+bool SPIFlashBlockDevice::begin() {
+  const SPIFlashInfo& info = _flash.chipInfo();
+  uint8_t smallest = 0xFF;
+  for (uint8_t i = 0; i < SPIFLASH_ERASETYPES; i++)
+    if (info.eraseSizeLog2[i] && info.eraseSizeLog2[i] < smallest) smallest = info.eraseSizeLog2[i];
+  if (smallest == 0xFF) return false;
+  _eraseLog2 = smallest;
+  _pageSize = info.pageSize;
+  if (!_size && info.capacity > _start) _size = info.capacity - _start;
+  _bufferBlock = SPIFLASH_NOPAGE;
+  _bufferDirty = false;
+  uint32_t mask = eraseSize() - 1;
+  if (!_size || (_start & mask) || (_size & mask)) return false;
+  if (!_buffer) {
+    uint32_t scratch = _flash.updateScratch();
+    if (scratch == SPIFLASH_NOPAGE || (scratch < _start + _size && _start < scratch + 0x2000)) return false;
+  }
+  return !info.capacity || (_start < info.capacity && _size <= info.capacity - _start);
+}
+
+/// smallest erase granularity of the chip, the littlefs block size
+uint32_t SPIFlashBlockDevice::eraseSize() {
+  return 1UL << _eraseLog2;
+}
+
+/// largest single program (the page size), a good littlefs cache_size
+uint16_t SPIFlashBlockDevice::programSize() {
+  return _pageSize;
+}
+
+uint32_t SPIFlashBlockDevice::blockCount() {
+  return _size >> _eraseLog2;
+}
+
+/// read len bytes at offset in an erase block, in one transaction
+bool SPIFlashBlockDevice::read(uint32_t block, uint32_t offset, void* buf, uint32_t len) {
+  if (block >= blockCount() || offset > eraseSize() || len > eraseSize() - offset) return false;
+  if (!flushBuffer()) return false;
+  _flash.readBytes(_start + (block << _eraseLog2) + offset, buf, len);
+  return true;
+}
+
+/// program len bytes at offset in an erase block (only clears bits, the block is expected to be erased)
+bool SPIFlashBlockDevice::prog(uint32_t block, uint32_t offset, const void* buf, uint32_t len) {
+  if (block >= blockCount() || offset > eraseSize() || len > eraseSize() - offset) return false;
+  uint32_t addr = _start + (block << _eraseLog2);
+  if (!flushBuffer()) return false;
+  if (addr == _bufferBlock) _bufferBlock = SPIFLASH_NOPAGE;
+  _flash.writeBytes(addr + offset, buf, len);
+  return true;
+}
+
+bool SPIFlashBlockDevice::erase(uint32_t block) {
+  if (block >= blockCount()) return false;
+  uint32_t addr = _start + (block << _eraseLog2);
+  if (!flushBuffer()) return false;
+  if (addr == _bufferBlock) _bufferBlock = SPIFLASH_NOPAGE;
+  return _flash.eraseRange(addr, eraseSize());
+}
+
+/// write out the buffered erase block and the SPIFlash write cache, then wait for the last program/erase
+/// Returns false if a block could not be written or the chip timed out
+bool SPIFlashBlockDevice::sync() {
+  bool ok = flushBuffer();
+  _flash.flush();
+  return _flash.waitReady() && ok;
+}
+
+/// number of SPIFLASHBD_SECTOR byte sectors
+uint32_t SPIFlashBlockDevice::sectorCount() {
+  return _size / SPIFLASHBD_SECTOR;
+}
+
+bool SPIFlashBlockDevice::readSector(uint32_t sector, uint8_t* dst) {
+  return readSectors(sector, dst, 1);
+}
+
+/// read count consecutive sectors in one transaction, the buffered erase block is patched in
+bool SPIFlashBlockDevice::readSectors(uint32_t sector, uint8_t* dst, size_t count) {
+  if (sector >= sectorCount() || count > sectorCount() - sector) return false;
+  uint32_t addr = _start + sector * (uint32_t) SPIFLASHBD_SECTOR;
+  uint32_t len = count * (uint32_t) SPIFLASHBD_SECTOR;
+  _flash.readBytes(addr, dst, len);
+  if (_bufferBlock != SPIFLASH_NOPAGE && _bufferBlock < addr + len && addr < _bufferBlock + eraseSize()) {
+    uint32_t from = addr > _bufferBlock ? addr : _bufferBlock;
+    uint32_t to = addr + len < _bufferBlock + eraseSize() ? addr + len : _bufferBlock + eraseSize();
+    memcpy(dst + (from - addr), _buffer + (from - _bufferBlock), to - from);
+  }
+  return true;
+}
+
+bool SPIFlashBlockDevice::writeSector(uint32_t sector, const uint8_t* src) {
+  return writeSectors(sector, src, 1);
+}
+
+/// rewrite count consecutive sectors, whole erase blocks are written directly, partial ones are merged
+/// into the erase buffer (or handed to SPIFlash::update() and its scratch when there is none)
+bool SPIFlashBlockDevice::writeSectors(uint32_t sector, const uint8_t* src, size_t count) {
+  if (sector >= sectorCount() || count > sectorCount() - sector) return false;
+  uint32_t addr = _start + sector * (uint32_t) SPIFLASHBD_SECTOR;
+  uint32_t len = count * (uint32_t) SPIFLASHBD_SECTOR;
+  if (!_buffer) return _flash.update(addr, src, len);
+  while (len) {
+    uint32_t block = addr & ~(eraseSize() - 1);
+    uint32_t n = block + eraseSize() - addr < len ? block + eraseSize() - addr : len;
+    if (block != _bufferBlock) {
+      if (!flushBuffer()) return false;
+      if (n == eraseSize()) {
+        _bufferBlock = SPIFLASH_NOPAGE;
+        if (!writeBlock(block, src)) return false;
+        addr += n;
+        src += n;
+        len -= n;
+        continue;
+      }
+      _flash.readBytes(block, _buffer, eraseSize());
+      _bufferBlock = block;
+    }
+    memcpy(_buffer + (addr - block), src, n);
+    _bufferDirty = true;
+    addr += n;
+    src += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool SPIFlashBlockDevice::syncDevice() {
+  return sync();
+}
+
+bool SPIFlashBlockDevice::isBusy() {
+  return _flash.busy();
+}
+
+/// rewrite a whole erase block: SPIFlash::update() programs it in place when that only clears bits (and
+/// erases through its journal when a scratch is set), otherwise erase it and program the pages that are not blank
+bool SPIFlashBlockDevice::writeBlock(uint32_t addr, const uint8_t* buf) {
+  if (_eraseLog2 == 12 && _flash.update(addr, buf, eraseSize())) return true;  // update() works on 4K sectors
+  if (!_flash.eraseRange(addr, eraseSize())) return false;
+  for (uint32_t offset = 0; offset < eraseSize(); offset += _pageSize) {
+    uint16_t i = 0;
+    while (i < _pageSize && buf[offset + i] == 0xFF) i++;
+    if (i < _pageSize) _flash.writeBytes(addr + offset, buf + offset, _pageSize);
+  }
+  return true;
+}
+
+/// write the erase buffer back if it holds changes, the block stays buffered
+bool SPIFlashBlockDevice::flushBuffer() {
+  if (!_bufferDirty) return true;
+  _bufferDirty = false;
+  return writeBlock(_bufferBlock, _buffer);
+}
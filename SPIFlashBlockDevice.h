@@ -0,0 +1,111 @@
+// Block device adapter for filesystems on top of SPIFlash (littlefs, SdFat/FatFs style sector I/O)
+// **********************************************************************************
+// Exposes an area of the chip with its real geometry: erase blocks of the smallest erase size the chip
+// has (usually 4K, from chipInfo()) and byte programmable, so littlefs can run on it directly:
+//   lfs_config cfg = {};
+//   cfg.cache_size = 256; cfg.lookahead_size = 16; cfg.block_cycles = 500;
+//   bd.configure(cfg);
+//   lfs_mount(&lfs, &cfg);
+// configure() fills in the callbacks, read/prog/block sizes and the block count, it is a template so this
+// header does not depend on lfs.h.
+// FAT sits on 512 byte sectors that are rewritten in place, readSectors/writeSectors (named after the SdFat
+// FsBlockDevice calls, easy to wrap for FatFs disk_read/disk_write) do the read-modify-erase-write:
+// - with an eraseBuffer (eraseSize() bytes) the erase block last written is kept in RAM, consecutive sector
+//   writes into it cost one erase + page programs when another block is touched or on syncDevice()
+// - without one every write goes through SPIFlash::update(), so begin() then requires flash.setUpdateScratch()
+//   to have been called (with the 8K scratch outside the device area) and returns false otherwise: there is
+//   no RAM to hold the rest of an erase block across its erase
+// Either way a block that only needs bits cleared is programmed in place, and with setUpdateScratch() the
+// erases go through its power loss safe journal.
+// A multi-sector read is one SPI transaction. Writes go through the SPIFlash write cache when it is set,
+// sync()/syncDevice() flush it.
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHBLOCKDEVICE_H_
+#define _SPIFLASHBLOCKDEVICE_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHBD_SECTOR         512         // sector size of readSectors/writeSectors
+#define SPIFLASHBD_ERR_IO         -5          // LFS_ERR_IO, what the littlefs callbacks return on failure
+
+class SPIFlashBlockDevice {
+public:
+  SPIFlashBlockDevice(SPIFlash& flash, uint32_t startAddress=0, uint32_t size=0, uint8_t* eraseBuffer=NULL);
+  bool begin();
+  uint32_t eraseSize();
+  uint16_t programSize();
+  uint32_t blockCount();
+
+  // littlefs block device
+  bool read(uint32_t block, uint32_t offset, void* buf, uint32_t len);
+  bool prog(uint32_t block, uint32_t offset, const void* buf, uint32_t len);
+  bool erase(uint32_t block);
+  bool sync();
+
+  /// point a littlefs lfs_config at this device, the cache/lookahead sizes and block_cycles stay the caller's
+  template<class Config>
+  void configure(Config& cfg) {
+    cfg.context = this;
+    cfg.read = lfsRead<Config>;
+    cfg.prog = lfsProg<Config>;
+    cfg.erase = lfsErase<Config>;
+    cfg.sync = lfsSync<Config>;
+    cfg.read_size = 1;
+    cfg.prog_size = 1;
+    cfg.block_size = eraseSize();
+    cfg.block_count = blockCount();
+  }
+
+  // sector I/O
+  uint32_t sectorCount();
+  bool readSector(uint32_t sector, uint8_t* dst);
+  bool readSectors(uint32_t sector, uint8_t* dst, size_t count);
+  bool writeSector(uint32_t sector, const uint8_t* src);
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t count);
+  bool syncDevice();
+  bool isBusy();
+protected:
+  template<class Config>
+  static int lfsRead(const Config* c, uint32_t block, uint32_t offset, void* buf, uint32_t len) {
+    return ((SPIFlashBlockDevice*) c->context)->read(block, offset, buf, len) ? 0 : SPIFLASHBD_ERR_IO;
+  }
+  template<class Config>
+  static int lfsProg(const Config* c, uint32_t block, uint32_t offset, const void* buf, uint32_t len) {
+    return ((SPIFlashBlockDevice*) c->context)->prog(block, offset, buf, len) ? 0 : SPIFLASHBD_ERR_IO;
+  }
+  template<class Config>
+  static int lfsErase(const Config* c, uint32_t block) {
+    return ((SPIFlashBlockDevice*) c->context)->erase(block) ? 0 : SPIFLASHBD_ERR_IO;
+  }
+  template<class Config>
+  static int lfsSync(const Config* c) {
+    return ((SPIFlashBlockDevice*) c->context)->sync() ? 0 : SPIFLASHBD_ERR_IO;
+  }
+  bool writeBlock(uint32_t addr, const uint8_t* buf);
+  bool flushBuffer();
+
+  SPIFlash& _flash;
+  uint32_t _start;
+  uint32_t _size;
+  uint8_t _eraseLog2;
+  uint16_t _pageSize;
+  uint8_t* _buffer;         // eraseSize() bytes, NULL when writes go straight through update()
+  uint32_t _bufferBlock;    // address of the block held in _buffer, SPIFLASH_NOPAGE when empty
+  bool _bufferDirty;
+};
+
+#endif
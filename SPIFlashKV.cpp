@@ -0,0 +1,309 @@
+// Power-fail-safe key/value store on top of SPIFlash
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashKV.h>
+
+/// Constructor. startAddress must be 4K aligned, the store uses 2*sectorsPerBank*4K bytes from there.
+/// slots is the hash index, it holds up to slotCount-1 keys (keep it ~25% larger than the key count)
+/// Call mount() after flash.initialize()
+SPIFlashKV::SPIFlashKV(SPIFlash& flash, uint32_t startAddress, uint16_t sectorsPerBank, SPIFlashKVSlot* slots, uint16_t slotCount) : _flash(flash) {
+  _start = startAddress;
+  _bankSectors = sectorsPerBank;
+  _slots = slots;
+  _slotCount = slotCount;
+  _count = 0;
+  _bank = 0;
+  _generation = 0;
+  _appendOffset = SPIFLASHKV_HEADER;
+}
+
+/// open the newest complete bank and index its entries, formats the area when there is no valid bank
+/// Returns false if the index has too few slots for the stored keys
+bool SPIFlashKV::mount() {
+  if (_bankSectors == 0 || _slotCount < 2) return false;
+  uint32_t gen0, gen1;
+  bool valid0 = readGeneration(0, gen0);
+  bool valid1 = readGeneration(1, gen1);
+  if (!valid0 && !valid1) return format();
+  _bank = (valid1 && (!valid0 || gen1 > gen0)) ? 1 : 0;
+  _generation = _bank ? gen1 : gen0;
+  // the other bank (old copy or an interrupted garbage collection) is erased lazily by gc()
+
+  for (uint16_t i = 0; i < _slotCount; i++) _slots[i].addr = 0;
+  _count = 0;
+  uint32_t bank = bankAddress(_bank);
+  uint32_t offset = SPIFLASHKV_HEADER;
+  while (offset + SPIFLASHKV_ENTRYHEADER <= bankSize()) {
+    uint8_t buf[SPIFLASHKV_ENTRYHEADER + SPIFLASHKV_MAXKEY];
+    uint16_t n = sizeof(buf);
+    if (n > bankSize() - offset) n = bankSize() - offset;
+    _flash.readBytes(bank + offset, buf, n);
+    uint16_t len = buf[1] | ((uint16_t) buf[2] << 8);
+    if (buf[0] == 0xFF && len == 0xFFFF) break;  // end of the entries
+    uint8_t keyLen = buf[0] & ~SPIFLASHKV_TOMBSTONE;
+    uint32_t size = SPIFLASHKV_ENTRYHEADER + keyLen + len;
+    if (keyLen == 0 || keyLen > SPIFLASHKV_MAXKEY || size > bankSize() - offset) { // torn header, nothing more is appended here
+      offset = bankSize();
+      break;
+    }
+
+    // entries torn by a power failure fail their CRC and are ignored
+    uint8_t crc = crc8(0, buf, 3);
+    crc = crc8(crc, buf + SPIFLASHKV_ENTRYHEADER, n < SPIFLASHKV_ENTRYHEADER + keyLen + len ? n - SPIFLASHKV_ENTRYHEADER : keyLen + len);
+    for (uint32_t pos = n; pos < size; pos += SPIFLASHKV_CHUNK) {
+      uint8_t chunk[SPIFLASHKV_CHUNK];
+      uint16_t c = size - pos < SPIFLASHKV_CHUNK ? size - pos : SPIFLASHKV_CHUNK;
+      _flash.readBytes(bank + offset + pos, chunk, c);
+      crc = crc8(crc, chunk, c);
+    }
+    if (crc == buf[3]) {
+      uint16_t tag = hash((const char*) buf + SPIFLASHKV_ENTRYHEADER, keyLen);
+      int32_t slot = find((const char*) buf + SPIFLASHKV_ENTRYHEADER, keyLen, tag);
+      if (buf[0] & SPIFLASHKV_TOMBSTONE) {
+        if (slot >= 0) erase(slot);
+      }
+      else if (slot >= 0) {
+        _slots[slot].addr = bank + offset;
+        _slots[slot].len = len;
+      }
+      else if (_count < _slotCount - 1) insert(tag, bank + offset, len);
+      else return false;
+    }
+    offset += size;
+  }
+  _appendOffset = offset;
+  return true;
+}
+
+/// erase both banks and start an empty store
+bool SPIFlashKV::format() {
+  if (_bankSectors == 0 || !_flash.eraseRange(_start, 2 * bankSize())) return false;
+  _bank = 0;
+  _generation = 1;
+  writeGeneration(0, _generation);
+  for (uint16_t i = 0; i < _slotCount; i++) _slots[i].addr = 0;
+  _count = 0;
+  _appendOffset = SPIFLASHKV_HEADER;
+  return true;
+}
+
+/// read the value of key into buf, returns its length or -1 when the key is not stored
+/// a value longer than maxLen is truncated (the return value is then larger than maxLen)
+/// When maxLen can hold the whole entry (header, key and value), this is a single readBytes
+int16_t SPIFlashKV::get(const char* key, void* buf, uint16_t maxLen) {
+  uint8_t keyLen = strlen(key);
+  if (keyLen == 0 || keyLen > SPIFLASHKV_MAXKEY) return -1;
+  uint16_t tag = hash(key, keyLen);
+  uint16_t i = tag % _slotCount;
+  while (_slots[i].addr) {
+    SPIFlashKVSlot& slot = _slots[i];
+    if (slot.tag == tag) {
+      uint8_t* out = (uint8_t*) buf;
+      uint32_t value = slot.addr + SPIFLASHKV_ENTRYHEADER + keyLen;
+      uint16_t header = SPIFLASHKV_ENTRYHEADER + keyLen;
+      if ((uint32_t) header + slot.len <= maxLen) {
+        // the entry is header, key, value: read it whole, check the stored key length and the key, move the value down
+        _flash.readBytes(slot.addr, out, header + slot.len);
+        if ((out[0] & ~SPIFLASHKV_TOMBSTONE) == keyLen && memcmp(out + SPIFLASHKV_ENTRYHEADER, key, keyLen) == 0) {
+          memmove(out, out + header, slot.len);
+          return slot.len;
+        }
+      }
+      else if (keyMatches(i, key, keyLen)) {
+        _flash.readBytes(value, out, slot.len < maxLen ? slot.len : maxLen);
+        return slot.len;
+      }
+    }
+    i = (i + 1) % _slotCount;
+  }
+  return -1;
+}
+
+/// store value under key (1 to SPIFLASHKV_MAXKEY characters), replacing any previous value
+/// garbage collects the banks first when the active one is full
+bool SPIFlashKV::put(const char* key, const void* value, uint16_t len) {
+  uint8_t keyLen = strlen(key);
+  if (keyLen == 0 || keyLen > SPIFLASHKV_MAXKEY || len == 0xFFFF) return false;
+  uint32_t size = SPIFLASHKV_ENTRYHEADER + keyLen + len;
+  if (size > bankSize() - SPIFLASHKV_HEADER) return false;
+  uint16_t tag = hash(key, keyLen);
+  int32_t slot = find(key, keyLen, tag);
+  if (slot < 0 && _count >= _slotCount - 1) return false;
+  if (size > freeSpace() && (!gc() || size > freeSpace())) return false;
+
+  uint32_t addr = append(key, keyLen, (const uint8_t*) value, len, false);
+  if (slot >= 0) {
+    _slots[slot].addr = addr;
+    _slots[slot].len = len;
+  }
+  else insert(tag, addr, len);
+  return true;
+}
+
+/// delete key, returns false if it was not stored
+bool SPIFlashKV::remove(const char* key) {
+  uint8_t keyLen = strlen(key);
+  if (keyLen == 0 || keyLen > SPIFLASHKV_MAXKEY) return false;
+  int32_t slot = find(key, keyLen, hash(key, keyLen));
+  if (slot < 0) return false;
+  uint32_t size = SPIFLASHKV_ENTRYHEADER + keyLen;
+  if (size > freeSpace()) {
+    erase(slot);  // the key is not copied, so it is gone as soon as the new bank is complete
+    return gc();
+  }
+  append(key, keyLen, NULL, 0, true);
+  erase(slot);
+  return true;
+}
+
+/// copy the live entries into the other bank and make it the active one
+/// put() calls this when needed, call it ahead of time to keep that latency out of a critical path
+bool SPIFlashKV::gc() {
+  uint8_t target = 1 - _bank;
+  uint32_t bank = bankAddress(target);
+  if (!_flash.isBlank(bank, bankSize()) && !_flash.eraseRange(bank, bankSize(), true)) return false;
+  uint32_t offset = SPIFLASHKV_HEADER;
+  for (uint16_t i = 0; i < _slotCount; i++) {
+    SPIFlashKVSlot& slot = _slots[i];
+    if (!slot.addr) continue;
+    uint8_t keyLen;
+    _flash.readBytes(slot.addr, &keyLen, 1);
+    uint32_t size = SPIFLASHKV_ENTRYHEADER + keyLen + slot.len;
+    for (uint32_t pos = 0; pos < size; pos += SPIFLASHKV_CHUNK) {
+      uint8_t chunk[SPIFLASHKV_CHUNK];
+      uint16_t n = size - pos < SPIFLASHKV_CHUNK ? size - pos : SPIFLASHKV_CHUNK;
+      _flash.readBytes(slot.addr + pos, chunk, n);
+      _flash.writeBytes(bank + offset + pos, chunk, n);
+    }
+    slot.addr = bank + offset;
+    offset += size;
+  }
+  // committing the new bank: from here on mount() picks it over the old one
+  writeGeneration(target, ++_generation);
+  _bank = target;
+  _appendOffset = offset;
+  return true;
+}
+
+/// number of stored keys
+uint16_t SPIFlashKV::count() {
+  return _count;
+}
+
+/// bytes left in the active bank before the next garbage collection
+uint32_t SPIFlashKV::freeSpace() {
+  return bankSize() - _appendOffset;
+}
+
+uint32_t SPIFlashKV::bankAddress(uint8_t bank) {
+  return _start + (uint32_t) bank * bankSize();
+}
+
+uint32_t SPIFlashKV::bankSize() {
+  return (uint32_t) _bankSectors * SPIFLASHKV_SECTOR;
+}
+
+/// read a bank header, returns false if the bank is not a complete store bank
+bool SPIFlashKV::readGeneration(uint8_t bank, uint32_t& generation) {
+  uint8_t hdr[SPIFLASHKV_HEADER];
+  _flash.readBytes(bankAddress(bank), hdr, SPIFLASHKV_HEADER);
+  uint32_t magic = hdr[0] | ((uint32_t) hdr[1] << 8) | ((uint32_t) hdr[2] << 16) | ((uint32_t) hdr[3] << 24);
+  generation = hdr[4] | ((uint32_t) hdr[5] << 8) | ((uint32_t) hdr[6] << 16) | ((uint32_t) hdr[7] << 24);
+  return magic == SPIFLASHKV_MAGIC && generation != 0xFFFFFFFF;
+}
+
+void SPIFlashKV::writeGeneration(uint8_t bank, uint32_t generation) {
+  uint8_t hdr[SPIFLASHKV_HEADER];
+  for (uint8_t i = 0; i < 4; i++) {
+    hdr[i] = (uint32_t) SPIFLASHKV_MAGIC >> (8*i);
+    hdr[4+i] = generation >> (8*i);
+  }
+  _flash.writeBytes(bankAddress(bank), hdr, SPIFLASHKV_HEADER);
+}
+
+/// append an entry at the end of the active bank (the caller checked it fits), returns its address
+uint32_t SPIFlashKV::append(const char* key, uint8_t keyLen, const uint8_t* value, uint16_t len, bool tombstone) {
+  uint8_t buf[SPIFLASHKV_ENTRYHEADER + SPIFLASHKV_MAXKEY];
+  buf[0] = keyLen | (tombstone ? SPIFLASHKV_TOMBSTONE : 0);
+  buf[1] = len;
+  buf[2] = len >> 8;
+  memcpy(buf + SPIFLASHKV_ENTRYHEADER, key, keyLen);
+  buf[3] = crc8(crc8(crc8(0, buf, 3), buf + SPIFLASHKV_ENTRYHEADER, keyLen), value, len);
+  uint32_t addr = bankAddress(_bank) + _appendOffset;
+  _flash.writeBytes(addr, buf, SPIFLASHKV_ENTRYHEADER + keyLen);
+  if (len) _flash.writeBytes(addr + SPIFLASHKV_ENTRYHEADER + keyLen, value, len);
+  _appendOffset += SPIFLASHKV_ENTRYHEADER + keyLen + len;
+  return addr;
+}
+
+bool SPIFlashKV::keyMatches(uint16_t slot, const char* key, uint8_t keyLen) {
+  uint8_t buf[SPIFLASHKV_ENTRYHEADER + SPIFLASHKV_MAXKEY];
+  _flash.readBytes(_slots[slot].addr, buf, SPIFLASHKV_ENTRYHEADER + keyLen);
+  return (buf[0] & ~SPIFLASHKV_TOMBSTONE) == keyLen && memcmp(buf + SPIFLASHKV_ENTRYHEADER, key, keyLen) == 0;
+}
+
+/// slot holding key, -1 if it is not indexed
+int32_t SPIFlashKV::find(const char* key, uint8_t keyLen, uint16_t tag) {
+  uint16_t i = tag % _slotCount;
+  while (_slots[i].addr) {
+    if (_slots[i].tag == tag && keyMatches(i, key, keyLen)) return i;
+    i = (i + 1) % _slotCount;
+  }
+  return -1;
+}
+
+void SPIFlashKV::insert(uint16_t tag, uint32_t addr, uint16_t len) {
+  uint16_t i = tag % _slotCount;
+  while (_slots[i].addr) i = (i + 1) % _slotCount;
+  _slots[i].addr = addr;
+  _slots[i].tag = tag;
+  _slots[i].len = len;
+  _count++;
+}
+
+/// remove a slot, moving back the following ones of the probe run so lookups need no tombstones
+void SPIFlashKV::erase(uint16_t slot) {
+  uint16_t i = slot, j = slot;
+  for (;;) {
+    j = (j + 1) % _slotCount;
+    if (!_slots[j].addr) break;
+    uint16_t home = _slots[j].tag % _slotCount;
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+    _slots[i] = _slots[j];
+    i = j;
+  }
+  _slots[i].addr = 0;
+  _count--;
+}
+
+/// 16 bit FNV-1a (32 bit hash folded)
+uint16_t SPIFlashKV::hash(const char* key, uint8_t keyLen) {
+  uint32_t h = 2166136261UL;
+  while (keyLen--) {
+    h ^= (uint8_t) *key++;
+    h *= 16777619UL;
+  }
+  return h ^ (h >> 16);
+}
+
+/// CRC-8 (poly 0x07), continued from crc
+uint8_t SPIFlashKV::crc8(uint8_t crc, const uint8_t* data, uint16_t len) {
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
@@ -0,0 +1,80 @@
+// Power-fail-safe key/value store on top of SPIFlash
+// **********************************************************************************
+// Entries are appended to the active one of two banks (each a run of 4K sectors), so changing a value
+// costs one append instead of a read/erase/rewrite of a whole sector. An entry is a 4 byte header
+// (key length, value length, CRC8) followed by the key and the value; a delete appends a tombstone.
+// When the active bank is full, the live entries are copied into the other bank whose header is written
+// last; the old bank is erased lazily by the next gc(), so a power failure at any point leaves one complete bank.
+// An open-addressing hash index (caller-supplied slots) is rebuilt at mount by walking the entries of the
+// active bank only, so mounting costs one read per entry written since the last garbage collection.
+// get() is a single readBytes when the buffer can hold the whole entry (header, key and value).
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHKV_H_
+#define _SPIFLASHKV_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHKV_SECTOR         4096
+#define SPIFLASHKV_MAGIC          0x564B4653  // "SFKV", little endian
+#define SPIFLASHKV_HEADER         8           // bank header: magic + generation
+#define SPIFLASHKV_ENTRYHEADER    4           // key length, value length (2 bytes), CRC8 of header + key + value
+#define SPIFLASHKV_MAXKEY         32
+#define SPIFLASHKV_TOMBSTONE      0x80        // key length flag of a delete
+#define SPIFLASHKV_CHUNK          32          // stack buffer used when copying/checking entries
+
+struct SPIFlashKVSlot {
+  uint32_t addr;            // entry address, 0 for an empty slot
+  uint16_t tag;             // key hash, gives the home slot and avoids flash reads on probe collisions
+  uint16_t len;             // value length
+};
+
+class SPIFlashKV {
+public:
+  SPIFlashKV(SPIFlash& flash, uint32_t startAddress, uint16_t sectorsPerBank, SPIFlashKVSlot* slots, uint16_t slotCount);
+  bool mount();
+  bool format();
+  int16_t get(const char* key, void* buf, uint16_t maxLen);
+  bool put(const char* key, const void* value, uint16_t len);
+  bool remove(const char* key);
+  bool gc();
+  uint16_t count();
+  uint32_t freeSpace();
+protected:
+  uint32_t bankAddress(uint8_t bank);
+  uint32_t bankSize();
+  bool readGeneration(uint8_t bank, uint32_t& generation);
+  void writeGeneration(uint8_t bank, uint32_t generation);
+  uint32_t append(const char* key, uint8_t keyLen, const uint8_t* value, uint16_t len, bool tombstone);
+  bool keyMatches(uint16_t slot, const char* key, uint8_t keyLen);
+  int32_t find(const char* key, uint8_t keyLen, uint16_t tag);
+  void insert(uint16_t tag, uint32_t addr, uint16_t len);
+  void erase(uint16_t slot);
+  static uint16_t hash(const char* key, uint8_t keyLen);
+  static uint8_t crc8(uint8_t crc, const uint8_t* data, uint16_t len);
+
+  SPIFlash& _flash;
+  uint32_t _start;
+  uint16_t _bankSectors;
+  SPIFlashKVSlot* _slots;
+  uint16_t _slotCount;
+  uint16_t _count;          // keys in the index
+  uint8_t _bank;            // active bank
+  uint32_t _generation;
+  uint32_t _appendOffset;   // inside the active bank
+};
+
+#endif
@@ -0,0 +1,223 @@
+// Circular append-only record log on top of SPIFlash
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashLog.h>
+
+/// Constructor. startAddress must be 4K aligned, the log uses sectors*4K bytes from there (at least 3 sectors)
+/// Call mount() after flash.initialize()
+SPIFlashLog::SPIFlashLog(SPIFlash& flash, uint32_t startAddress, uint16_t sectors) : _flash(flash) {
+  _start = startAddress;
+  _sectors = sectors;
+  _head = _tail = 0;
+  _headSeq = 0;
+  _headOffset = SPIFLASHLOG_HEADER;
+  _eraseToken = 0;
+  _itSector = SPIFLASHLOG_NOSECTOR;
+  _itOffset = 0;
+}
+
+/// find the head and tail of an existing log, formats the area when there is no valid log in it
+/// The sectors holding records form one run around the ring with consecutive sequence numbers,
+/// so both ends are found with a binary search over sector headers (O(log sectors) header reads),
+/// only the records of the head sector are walked to find the append position
+bool SPIFlashLog::mount() {
+  if (_sectors < 3) return false;
+  uint32_t seq0, seq;
+  uint16_t head, lo, hi;
+  if (readSequence(0, seq0)) {
+    // sectors 0..head hold seq0, seq0+1, ... and nothing after the head continues that run
+    lo = 0;
+    hi = _sectors - 1;
+    while (lo < hi) {
+      uint16_t mid = lo + (hi - lo + 1) / 2;
+      if (readSequence(mid, seq) && seq == seq0 + mid) lo = mid; else hi = mid - 1;
+    }
+    head = lo;
+  }
+  else if (readSequence(_sectors - 1, seq)) head = _sectors - 1;  // sector 0 is the erase-ahead of the last sector
+  else return format();
+  readSequence(head, _headSeq);
+
+  // going backwards from the head, at most sectors-1 sectors continue the run (one is kept erased)
+  lo = 0;
+  hi = _sectors - 2;
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo + 1) / 2;
+    if (readSequence((head + _sectors - mid) % _sectors, seq) && seq == _headSeq - mid) lo = mid; else hi = mid - 1;
+  }
+  _head = head;
+  _tail = (head + _sectors - lo) % _sectors;
+
+  // append position: follow the record lengths through the head sector
+  _headOffset = SPIFLASHLOG_HEADER;
+  while (_headOffset + SPIFLASHLOG_RECHEADER <= SPIFLASHLOG_SECTOR) {
+    uint8_t hdr[2];
+    _flash.readBytes(sectorAddress(_head) + _headOffset, hdr, 2);
+    uint16_t len = hdr[0] | ((uint16_t) hdr[1] << 8);
+    if (len == 0xFFFF) break;
+    if (len > SPIFLASHLOG_SECTOR - _headOffset - SPIFLASHLOG_RECHEADER) { // torn length, nothing more fits here
+      _headOffset = SPIFLASHLOG_SECTOR;
+      break;
+    }
+    _headOffset += SPIFLASHLOG_RECHEADER + len;
+  }
+
+  // the erase-ahead sector may still hold old records if its erase was cut short
+  uint32_t ahead = sectorAddress((_head + 1) % _sectors);
+  if (!_flash.isBlank(ahead, SPIFLASHLOG_SECTOR)) _flash.blockErase4K(ahead);
+  _eraseToken = 0;
+  rewind();
+  return true;
+}
+
+/// erase the whole log area and start an empty log
+bool SPIFlashLog::format() {
+  if (_sectors < 3 || !_flash.eraseRange(_start, (uint32_t) _sectors * SPIFLASHLOG_SECTOR)) return false;
+  _head = _tail = 0;
+  _headSeq = 1;
+  startSector(0, _headSeq);
+  _headOffset = SPIFLASHLOG_HEADER;
+  _eraseToken = 0;
+  rewind();
+  return true;
+}
+
+/// append one record (1 to SPIFLASHLOG_MAXRECORD bytes), moving to the next sector when it does not fit
+/// the oldest sector is dropped when the ring is full
+bool SPIFlashLog::append(const void* record, uint16_t len) {
+  if (len == 0 || len > SPIFLASHLOG_MAXRECORD) return false;
+  if (_headOffset + SPIFLASHLOG_RECHEADER + len > SPIFLASHLOG_SECTOR) rotate();
+  uint8_t hdr[SPIFLASHLOG_RECHEADER];
+  hdr[0] = len;
+  hdr[1] = len >> 8;
+  hdr[2] = crc8((const uint8_t*) record, len);
+  // header and data go out in the same page programs, which suspend the erase-ahead if it is still running
+  _flash.writeBytes(sectorAddress(_head) + _headOffset, hdr, SPIFLASHLOG_RECHEADER, record, len);
+  _headOffset += SPIFLASHLOG_RECHEADER + len;
+  return true;
+}
+
+/// advance the queued erase-ahead, call this regularly (ie. every loop)
+void SPIFlashLog::service() {
+  _flash.service();
+  if (_eraseToken && _flash.opStatus(_eraseToken) == SPIFLASH_OP_DONE) _eraseToken = 0;
+}
+
+/// move the head into the (already erased) next sector and queue the erase of the one after it
+bool SPIFlashLog::rotate() {
+  uint16_t next = (_head + 1) % _sectors;
+  while (_eraseToken) { // only when appends outran the erase-ahead
+    service();
+    yield();
+  }
+  _headSeq++;
+  startSector(next, _headSeq);
+  _head = next;
+  _headOffset = SPIFLASHLOG_HEADER;
+
+  uint16_t ahead = (next + 1) % _sectors;
+  if (ahead == _tail) {
+    _tail = (_tail + 1) % _sectors;
+    if (_itSector == ahead) rewind();
+    _eraseToken = _flash.queueBlockErase4K(sectorAddress(ahead));
+    if (!_eraseToken && _flash.lastError() == SPIFLASH_ERR_QUEUEFULL) _flash.blockErase4K(sectorAddress(ahead));
+  }
+  return true;
+}
+
+/// position the iterator at the oldest record
+void SPIFlashLog::rewind() {
+  _itSector = _tail;
+  _itOffset = SPIFLASHLOG_HEADER;
+}
+
+/// read the next record into buf, returns its length or -1 when there are no more records
+/// a record longer than maxLen is truncated (the return value is then larger than maxLen)
+/// records that fail their CRC (torn by a power failure) are skipped
+int16_t SPIFlashLog::next(void* buf, uint16_t maxLen) {
+  while (_itSector != SPIFLASHLOG_NOSECTOR) {
+    if (_itSector == _head && _itOffset >= _headOffset) return -1;
+    uint16_t len = 0xFFFF;
+    uint8_t crc = 0;
+    if (_itOffset + SPIFLASHLOG_RECHEADER <= SPIFLASHLOG_SECTOR) {
+      uint8_t hdr[SPIFLASHLOG_RECHEADER];
+      _flash.readBytes(sectorAddress(_itSector) + _itOffset, hdr, SPIFLASHLOG_RECHEADER);
+      len = hdr[0] | ((uint16_t) hdr[1] << 8);
+      crc = hdr[2];
+    }
+    if (len == 0xFFFF || len > SPIFLASHLOG_SECTOR - _itOffset - SPIFLASHLOG_RECHEADER) { // end of this sector
+      if (_itSector == _head) return -1;
+      _itSector = (_itSector + 1) % _sectors;
+      _itOffset = SPIFLASHLOG_HEADER;
+      continue;
+    }
+    uint32_t addr = sectorAddress(_itSector) + _itOffset + SPIFLASHLOG_RECHEADER;
+    _itOffset += SPIFLASHLOG_RECHEADER + len;
+    if (len > maxLen) {
+      _flash.readBytes(addr, buf, maxLen);
+      return len;
+    }
+    _flash.readBytes(addr, buf, len);
+    if (crc8((const uint8_t*) buf, len) == crc) return len;
+  }
+  return -1;
+}
+
+/// sequence number of the sector being appended to
+uint32_t SPIFlashLog::headSequence() {
+  return _headSeq;
+}
+
+/// sequence number of the oldest sector
+uint32_t SPIFlashLog::tailSequence() {
+  return _headSeq - (_head + _sectors - _tail) % _sectors;
+}
+
+bool SPIFlashLog::isEmpty() {
+  return _head == _tail && _headOffset == SPIFLASHLOG_HEADER;
+}
+
+uint32_t SPIFlashLog::sectorAddress(uint16_t sector) {
+  return _start + (uint32_t) sector * SPIFLASHLOG_SECTOR;
+}
+
+/// read a sector header, returns false if the sector is erased or not a log sector
+bool SPIFlashLog::readSequence(uint16_t sector, uint32_t& seq) {
+  uint8_t hdr[SPIFLASHLOG_HEADER];
+  _flash.readBytes(sectorAddress(sector), hdr, SPIFLASHLOG_HEADER);
+  uint32_t magic = hdr[0] | ((uint32_t) hdr[1] << 8) | ((uint32_t) hdr[2] << 16) | ((uint32_t) hdr[3] << 24);
+  seq = hdr[4] | ((uint32_t) hdr[5] << 8) | ((uint32_t) hdr[6] << 16) | ((uint32_t) hdr[7] << 24);
+  return magic == SPIFLASHLOG_MAGIC && seq != 0xFFFFFFFF;
+}
+
+void SPIFlashLog::startSector(uint16_t sector, uint32_t seq) {
+  uint8_t hdr[SPIFLASHLOG_HEADER];
+  for (uint8_t i = 0; i < 4; i++) {
+    hdr[i] = (uint32_t) SPIFLASHLOG_MAGIC >> (8*i);
+    hdr[4+i] = seq >> (8*i);
+  }
+  _flash.writeBytes(sectorAddress(sector), hdr, SPIFLASHLOG_HEADER);
+}
+
+/// CRC-8 (poly 0x07)
+uint8_t SPIFlashLog::crc8(const uint8_t* data, uint16_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
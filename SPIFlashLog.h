@@ -0,0 +1,72 @@
+// Circular append-only record log on top of SPIFlash
+// **********************************************************************************
+// Records are appended into 4K sectors used as a ring. Each sector starts with a small header holding
+// a sequence number, so at mount time the newest (head) and oldest (tail) sectors are found with a
+// binary search over sector headers instead of a linear scan.
+// One sector past the head is always kept erased (erase-ahead): rotating into it only programs its
+// header, and erasing the one after (the oldest sector) is queued on the SPIFlash non-blocking queue,
+// so call service() from the main loop. Appends never wait for that erase: their page programs suspend it
+// (SPIFlash::setProgramSuspend, on by default on chips that can suspend erases) and resume it afterwards.
+// A record is a 3 byte header (length + CRC8) followed by the data, written together with one page program
+// per page it spans. A record torn by a power failure fails its CRC and is skipped when reading.
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHLOG_H_
+#define _SPIFLASHLOG_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHLOG_SECTOR        4096
+#define SPIFLASHLOG_MAGIC         0x474C4653  // "SFLG", little endian
+#define SPIFLASHLOG_HEADER        8           // sector header: magic + sequence number
+#define SPIFLASHLOG_RECHEADER     3           // record header: length (2 bytes) + CRC8 of the data
+#define SPIFLASHLOG_MAXRECORD     (SPIFLASHLOG_SECTOR - SPIFLASHLOG_HEADER - SPIFLASHLOG_RECHEADER)
+#define SPIFLASHLOG_NOSECTOR      0xFFFF
+
+class SPIFlashLog {
+public:
+  SPIFlashLog(SPIFlash& flash, uint32_t startAddress, uint16_t sectors);
+  bool mount();
+  bool format();
+  bool append(const void* record, uint16_t len);
+  void service();
+
+  void rewind();
+  int16_t next(void* buf, uint16_t maxLen);
+
+  uint32_t headSequence();
+  uint32_t tailSequence();
+  bool isEmpty();
+protected:
+  uint32_t sectorAddress(uint16_t sector);
+  bool readSequence(uint16_t sector, uint32_t& seq);
+  void startSector(uint16_t sector, uint32_t seq);
+  bool rotate();
+  static uint8_t crc8(const uint8_t* data, uint16_t len);
+
+  SPIFlash& _flash;
+  uint32_t _start;
+  uint16_t _sectors;
+  uint16_t _head;           // sector being appended to
+  uint16_t _tail;           // oldest sector still holding records
+  uint32_t _headSeq;
+  uint16_t _headOffset;     // append position inside the head sector
+  uint8_t _eraseToken;      // queued erase-ahead of the sector after the head, 0 when none
+  uint16_t _itSector;       // iterator position
+  uint16_t _itOffset;
+};
+
+#endif
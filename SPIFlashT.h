@@ -0,0 +1,297 @@
+// Compile-time specialized SPI flash driver
+// **********************************************************************************
+// SPIFlashT<Traits, Bus> is a lean, header-only counterpart of SPIFlash for a chip and board known at
+// compile time. Traits fixes the geometry, opcodes and timing (see SPIFlashTraits), Bus is a policy class
+// of static functions (see SPIFlashSPIBus), so the page split math, address packing and chip select
+// toggling constant-fold and the per-byte loops inline. There is no virtual call, runtime chip info,
+// cache or queue: use SPIFlash for those, or for chips only known at run time (SFDP).
+// Example, a Moteino with its W25X40CL on pin 8:
+//   SPIFlashT<SPIFlashTraitsW25X40, SPIFlashSPIBus<SS_FLASHMEM> > flash;
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHT_H_
+#define _SPIFLASHT_H_
+
+#include <SPIFlash.h>
+
+/// Chip description, derive from it and override what differs (all members are compile-time constants)
+struct SPIFlashTraits {
+  static const uint32_t capacity = 0;                     // bytes, 0 disables the range checks
+  static const uint16_t jedecID = 0;                      // manufacturer + device ID checked by initialize(), 0 = any
+  static const uint16_t pageSize = 256;                   // a power of 2
+  static const uint8_t addressBytes = 3;
+  static const uint8_t readOpcode = SPIFLASH_ARRAYREAD;
+  static const uint8_t readDummy = 1;                     // dummy bytes after the address
+  static const uint8_t programOpcode = SPIFLASH_BYTEPAGEPROGRAM;
+  static const uint8_t erase4KOpcode = SPIFLASH_BLOCKERASE_4K;
+  static const uint8_t erase32KOpcode = SPIFLASH_BLOCKERASE_32K;
+  static const uint8_t erase64KOpcode = SPIFLASH_BLOCKERASE_64K;
+  static const uint16_t pageProgramUs = SPIFLASH_TPP_US;  // typical times, waits give up after SPIFLASH_TMAX_MULTIPLIER times them
+  static const uint16_t statusWriteMs = SPIFLASH_TW_MS;
+  static const uint16_t erase4KMs = SPIFLASH_TSE_MS;
+  static const uint16_t erase32KMs = SPIFLASH_TBE32_MS;
+  static const uint16_t erase64KMs = SPIFLASH_TBE64_MS;
+  static const uint16_t chipEraseMs = SPIFLASH_TCE_MS;
+};
+
+/// Winbond W25X40CL, 4Mbit, as on the Moteino
+struct SPIFlashTraitsW25X40 : SPIFlashTraits {
+  static const uint32_t capacity = 0x80000;
+  static const uint16_t jedecID = 0xEF30;
+};
+
+/// Winbond W25Q family of 2^densityLog2 bytes (ie. 22 for the 32Mbit W25Q32), 4-byte opcodes above 16MB
+template<uint8_t densityLog2>
+struct SPIFlashTraitsW25Q : SPIFlashTraits {
+  static const uint32_t capacity = 1UL << densityLog2;
+  static const uint16_t jedecID = 0xEF40;
+  static const uint8_t addressBytes = densityLog2 > 24 ? 4 : 3;
+  static const uint8_t readOpcode = addressBytes == 4 ? SPIFLASH_ARRAYREAD4B : SPIFLASH_ARRAYREAD;
+  static const uint8_t programOpcode = addressBytes == 4 ? SPIFLASH_BYTEPAGEPROGRAM4B : SPIFLASH_BYTEPAGEPROGRAM;
+  static const uint8_t erase4KOpcode = addressBytes == 4 ? SPIFLASH_BLOCKERASE_4K4B : SPIFLASH_BLOCKERASE_4K;
+  static const uint8_t erase32KOpcode = addressBytes == 4 ? SPIFLASH_BLOCKERASE_32K4B : SPIFLASH_BLOCKERASE_32K;
+  static const uint8_t erase64KOpcode = addressBytes == 4 ? SPIFLASH_BLOCKERASE_64K4B : SPIFLASH_BLOCKERASE_64K;
+  static const uint16_t pageProgramUs = 400;
+  static const uint16_t chipEraseMs = 10000;
+};
+
+/// Bus policy for a chip select pin on an Arduino SPIClass (the global SPI by default)
+/// On AVR chip select goes through the pin's port register instead of digitalWrite.
+template<uint8_t csPin, uint32_t clock = 8000000, SPIClass& spi = SPI>
+class SPIFlashSPIBus {
+public:
+  static void begin() {
+    pinMode(csPin, OUTPUT);
+    digitalWrite(csPin, HIGH);
+#if defined(__AVR__)
+    _csPort = portOutputRegister(digitalPinToPort(csPin));
+    _csMask = digitalPinToBitMask(csPin);
+#endif
+    spi.begin();
+  }
+  static void end() { spi.end(); }
+  static void select() {
+    spi.beginTransaction(SPISettings(clock, MSBFIRST, SPI_MODE0));
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();  // the port may be shared with pins written from interrupts
+    *_csPort &= ~_csMask;
+    SREG = sreg;
+#else
+    digitalWrite(csPin, LOW);
+#endif
+  }
+  static void unselect() {
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+    *_csPort |= _csMask;
+    SREG = sreg;
+#else
+    digitalWrite(csPin, HIGH);
+#endif
+    spi.endTransaction();
+  }
+  static uint8_t transfer(uint8_t data) { return spi.transfer(data); }
+  static void read(uint8_t* buf, uint16_t len) {
+    while (len--) *buf++ = spi.transfer(0);
+  }
+  static void write(const uint8_t* buf, uint16_t len) {
+    while (len--) spi.transfer(*buf++);
+  }
+#if defined(__AVR__)
+private:
+  static volatile uint8_t* _csPort;
+  static uint8_t _csMask;
+#endif
+};
+
+#if defined(__AVR__)
+template<uint8_t csPin, uint32_t clock, SPIClass& spi>
+volatile uint8_t* SPIFlashSPIBus<csPin, clock, spi>::_csPort;
+template<uint8_t csPin, uint32_t clock, SPIClass& spi>
+uint8_t SPIFlashSPIBus<csPin, clock, spi>::_csMask;
+#endif
+
+template<class Traits, class Bus>
+class SPIFlashT {
+public:
+  uint8_t UNIQUEID[8];
+
+  /// until the first program/erase sets it, waits allow for the longest one (a chip erase started before an MCU reset)
+  SPIFlashT() : _waitMaxUs((uint32_t) Traits::chipEraseMs * 1000 * SPIFLASH_TMAX_MULTIPLIER) {}
+
+  /// setup the bus, wake the chip, check its ID (when Traits::jedecID is set) and clear the block protection
+  bool initialize() {
+    Bus::begin();
+    wakeup();
+    if (Traits::jedecID && readDeviceId() != Traits::jedecID) return false;
+    command(SPIFLASH_STATUSWRITE, true);
+    Bus::transfer(0);
+    Bus::unselect();
+    _waitMaxUs = (uint32_t) Traits::statusWriteMs * 1000 * SPIFLASH_TMAX_MULTIPLIER;
+    return true;
+  }
+
+  static uint32_t capacity() { return Traits::capacity; }
+  static uint16_t pageSize() { return Traits::pageSize; }
+
+  uint16_t readDeviceId() {
+    command(SPIFLASH_IDREAD);
+    uint16_t id = Bus::transfer(0) << 8;
+    id |= Bus::transfer(0);
+    Bus::unselect();
+    return id;
+  }
+
+  uint8_t* readUniqueId() {
+    command(SPIFLASH_MACREAD);
+    for (uint8_t i = 0; i < 4; i++) Bus::transfer(0);
+    Bus::read(UNIQUEID, 8);
+    Bus::unselect();
+    return UNIQUEID;
+  }
+
+  uint8_t readStatus() {
+    Bus::select();
+    Bus::transfer(SPIFLASH_STATUSREAD);
+    uint8_t status = Bus::transfer(0);
+    Bus::unselect();
+    return status;
+  }
+
+  bool busy() {
+    return readStatus() & 1;
+  }
+
+  /// wait for the last program/erase, false if it outlived its maximum time
+  bool waitReady() {
+    uint32_t start = micros();
+    while (busy()) {
+      if (micros() - start > _waitMaxUs) return false;
+      yield();
+    }
+    _waitMaxUs = 0;
+    return true;
+  }
+
+  uint8_t readByte(uint32_t addr) {
+    uint8_t b = 0xFF;
+    readBytes(addr, &b, 1);
+    return b;
+  }
+
+  /// one continuous read, whatever len
+  void readBytes(uint32_t addr, void* buf, uint32_t len) {
+    if (!inRange(addr, len)) return;
+    command(Traits::readOpcode);
+    sendAddress(addr);
+    for (uint8_t i = 0; i < Traits::readDummy; i++) Bus::transfer(0);
+    uint8_t* out = (uint8_t*) buf;
+    while (len) {
+      uint16_t n = len < SPIFLASH_READCHUNK ? len : SPIFLASH_READCHUNK;
+      Bus::read(out, n);
+      out += n;
+      len -= n;
+    }
+    Bus::unselect();
+  }
+
+  void writeByte(uint32_t addr, uint8_t byt) {
+    writeBytes(addr, &byt, 1);
+  }
+
+  /// program len bytes, split on Traits::pageSize boundaries
+  void writeBytes(uint32_t addr, const void* buf, uint32_t len) {
+    if (!inRange(addr, len)) return;
+    const uint8_t* in = (const uint8_t*) buf;
+    while (len) {
+      uint16_t n = Traits::pageSize - (addr & (Traits::pageSize - 1));
+      if (n > len) n = len;
+      command(Traits::programOpcode, true);
+      sendAddress(addr);
+      Bus::write(in, n);
+      Bus::unselect();
+      _waitMaxUs = (uint32_t) Traits::pageProgramUs * SPIFLASH_TMAX_MULTIPLIER;
+      addr += n;
+      in += n;
+      len -= n;
+    }
+  }
+
+  void blockErase4K(uint32_t addr) { erase(Traits::erase4KOpcode, addr, Traits::erase4KMs); }
+  void blockErase32K(uint32_t addr) { erase(Traits::erase32KOpcode, addr, Traits::erase32KMs); }
+  void blockErase64K(uint32_t addr) { erase(Traits::erase64KOpcode, addr, Traits::erase64KMs); }
+
+  void chipErase() {
+    command(SPIFLASH_CHIPERASE, true);
+    Bus::unselect();
+    _waitMaxUs = (uint32_t) Traits::chipEraseMs * 1000 * SPIFLASH_TMAX_MULTIPLIER;
+  }
+
+  void sleep() {
+    command(SPIFLASH_SLEEP);
+    Bus::unselect();
+  }
+
+  void wakeup() {
+    Bus::select();
+    Bus::transfer(SPIFLASH_WAKE);
+    Bus::unselect();
+    delayMicroseconds(SPIFLASH_TRES1_US);  // tRES1 before the next command
+  }
+
+  void end() {
+    waitReady();
+    Bus::end();
+  }
+
+protected:
+  /// wait for the previous program/erase, then select and send cmd (after a write enable when isWrite)
+  void command(uint8_t cmd, bool isWrite=false) {
+    waitReady();
+    if (isWrite) {
+      Bus::select();
+      Bus::transfer(SPIFLASH_WRITEENABLE);
+      Bus::unselect();
+    }
+    Bus::select();
+    Bus::transfer(cmd);
+  }
+
+  static void sendAddress(uint32_t addr) {
+    if (Traits::addressBytes == 4) Bus::transfer(addr >> 24);
+    Bus::transfer(addr >> 16);
+    Bus::transfer(addr >> 8);
+    Bus::transfer(addr);
+  }
+
+  static bool inRange(uint32_t addr, uint32_t len) {
+    return !Traits::capacity || (addr < Traits::capacity && len <= Traits::capacity - addr);
+  }
+
+  void erase(uint8_t opcode, uint32_t addr, uint16_t typMs) {
+    if (!inRange(addr, 1)) return;
+    command(opcode, true);
+    sendAddress(addr);
+    Bus::unselect();
+    _waitMaxUs = (uint32_t) typMs * 1000 * SPIFLASH_TMAX_MULTIPLIER;
+  }
+
+  uint32_t _waitMaxUs;  // how long the chip may stay busy with the last program/erase
+};
+
+#endif
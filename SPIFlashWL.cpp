@@ -0,0 +1,270 @@
+// Wear-leveling block layer on top of SPIFlash
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashWL.h>
+
+static uint8_t mapBits(uint16_t physicalSectors) {
+  uint8_t bits = 1;
+  while (bits < 16 && ((uint32_t) 1 << bits) <= physicalSectors) bits++;
+  return bits;
+}
+
+/// RAM needed for the mapping table of physicalSectors sectors (ie. 7KB for a whole 16MB chip)
+uint16_t SPIFlashWL::bufferSize(uint16_t physicalSectors) {
+  return ((uint32_t) physicalSectors * mapBits(physicalSectors) + 7) / 8 + (physicalSectors + 7) / 8;
+}
+
+/// Constructor. startAddress must be 4K aligned, the layer uses physicalSectors*4K bytes from there
+/// (at least SPIFLASHWL_SPARES+1) and buffer must hold bufferSize(physicalSectors) bytes
+/// Call mount() after flash.initialize()
+SPIFlashWL::SPIFlashWL(SPIFlash& flash, uint32_t startAddress, uint16_t physicalSectors, uint8_t* buffer) : _flash(flash) {
+  _start = startAddress;
+  _physical = physicalSectors;
+  _bits = mapBits(physicalSectors);
+  _map = buffer;
+  _used = buffer + ((uint32_t) physicalSectors * _bits + 7) / 8;
+  _version = 0;
+  _cursor = 0;
+  _ahead = physicalSectors;
+  _aheadCount = 0;
+  _aheadToken = 0;
+  _staticCursor = 0;
+  _writes = 0;
+}
+
+/// rebuild the mapping table from the sector headers (one header read per physical sector)
+/// When a write was cut by a power failure, the copy with the highest version wins
+bool SPIFlashWL::mount() {
+  if (_physical <= SPIFLASHWL_SPARES) return false;
+  for (uint16_t l = 0; l < sectors(); l++) setMap(l, _physical);
+  memset(_used, 0, (_physical + 7) / 8);
+  _version = 0;
+  uint16_t newest = _physical - 1;
+  for (uint16_t p = 0; p < _physical; p++) {
+    uint16_t logical;
+    uint32_t count, version;
+    if (!readHeader(p, logical, count, version) || logical >= sectors()) continue;
+    uint16_t other = getMap(logical);
+    if (other != _physical) {
+      uint16_t otherLogical;
+      uint32_t otherCount, otherVersion;
+      readHeader(other, otherLogical, otherCount, otherVersion);
+      if (otherVersion > version) continue;
+      setUsed(other, false);
+    }
+    setMap(logical, p);
+    setUsed(p, true);
+    if (version >= _version) {
+      _version = version;
+      newest = p;
+    }
+  }
+  // carry on the rotation where it stopped
+  _cursor = (newest + 1) % _physical;
+  _staticCursor = 0;
+  _writes = 0;
+  _aheadToken = 0;
+  _ahead = _physical;
+  prepareAhead();
+  return true;
+}
+
+/// erase the whole area, every logical sector reads back as 0xFF
+/// erase counts are lost, prefer writing over existing sectors to formatting again
+bool SPIFlashWL::format() {
+  if (_physical <= SPIFLASHWL_SPARES) return false;
+  while (_aheadToken) {
+    service();
+    yield();
+  }
+  if (!_flash.eraseRange(_start, (uint32_t) _physical * SPIFLASHWL_SECTOR)) return false;
+  return mount();
+}
+
+/// number of logical sectors
+uint16_t SPIFlashWL::sectors() {
+  return _physical - SPIFLASHWL_SPARES;
+}
+
+/// read len bytes at offset of a logical sector, a sector never written reads as 0xFF
+bool SPIFlashWL::read(uint16_t logical, uint16_t offset, void* buf, uint16_t len) {
+  if (logical >= sectors() || offset > SPIFLASHWL_DATA || len > SPIFLASHWL_DATA - offset) return false;
+  uint16_t p = getMap(logical);
+  if (p == _physical) memset(buf, 0xFF, len);
+  else _flash.readBytes(sectorAddress(p) + SPIFLASHWL_HEADER + offset, buf, len);
+  return true;
+}
+
+/// write len bytes at offset of a logical sector, the rest of the sector is kept
+/// The sector is copied into the pre-erased spare, so no erase is waited for unless the previous
+/// write left no time for the queued erase to finish
+bool SPIFlashWL::write(uint16_t logical, uint16_t offset, const void* buf, uint16_t len) {
+  if (logical >= sectors() || offset > SPIFLASHWL_DATA || len > SPIFLASHWL_DATA - offset) return false;
+  if (!rewrite(logical, offset, (const uint8_t*) buf, len)) return false;
+  if (++_writes >= SPIFLASHWL_STATIC_INTERVAL) {
+    _writes = 0;
+    staticLevel();
+  }
+  return true;
+}
+
+/// advance the queued erase of the spare, call this regularly (ie. every loop)
+void SPIFlashWL::service() {
+  _flash.service();
+  if (_aheadToken && _flash.opStatus(_aheadToken) == SPIFLASH_OP_DONE) _aheadToken = 0;
+}
+
+/// physical sector holding a logical sector, sectors() + SPIFLASHWL_SPARES if it was never written
+uint16_t SPIFlashWL::physicalSector(uint16_t logical) {
+  return logical < sectors() ? getMap(logical) : _physical;
+}
+
+/// erase count recorded in a physical sector's header (0 for a sector never used)
+uint32_t SPIFlashWL::eraseCount(uint16_t physical) {
+  if (physical == _ahead) return _aheadCount;
+  uint16_t logical;
+  uint32_t count, version;
+  return physical < _physical && readHeader(physical, logical, count, version) ? count : 0;
+}
+
+/// copy a logical sector into the spare with buf overlaid at offset (nothing overlaid when len is 0),
+/// then commit it by writing the header last
+bool SPIFlashWL::rewrite(uint16_t logical, uint16_t offset, const uint8_t* buf, uint16_t len) {
+  while (_aheadToken) {
+    service();
+    yield();
+  }
+  if (_ahead == _physical) return false;
+  uint16_t dst = _ahead;
+  uint16_t src = getMap(logical);
+  uint8_t chunk[SPIFLASHWL_CHUNK];
+  uint16_t pos = 0;
+  while (pos < SPIFLASHWL_DATA) {
+    // chunks are aligned on the flash so that none straddles a page
+    uint16_t n = SPIFLASHWL_CHUNK - (SPIFLASHWL_HEADER + pos) % SPIFLASHWL_CHUNK;
+    if (n > SPIFLASHWL_DATA - pos) n = SPIFLASHWL_DATA - pos;
+    if (src == _physical) memset(chunk, 0xFF, n);
+    else if (!len || pos < offset || pos + n > offset + len)  // not entirely overwritten
+      _flash.readBytes(sectorAddress(src) + SPIFLASHWL_HEADER + pos, chunk, n);
+    if (len && pos < offset + len && pos + n > offset) {
+      uint16_t from = pos > offset ? pos : offset;
+      uint16_t to = pos + n < offset + len ? pos + n : offset + len;
+      memcpy(chunk + from - pos, buf + from - offset, to - from);
+    }
+    uint16_t i = 0;
+    while (i < n && chunk[i] == 0xFF) i++;
+    if (i < n) _flash.writeBytes(sectorAddress(dst) + SPIFLASHWL_HEADER + pos, chunk, n);
+    pos += n;
+  }
+
+  uint8_t hdr[SPIFLASHWL_HEADER];
+  uint32_t magic = SPIFLASHWL_MAGIC;
+  _version++;
+  for (uint8_t i = 0; i < 4; i++) {
+    hdr[i] = magic >> (8*i);
+    hdr[8+i] = _aheadCount >> (8*i);
+    hdr[12+i] = _version >> (8*i);
+  }
+  hdr[4] = logical;
+  hdr[5] = logical >> 8;
+  hdr[6] = hdr[7] = 0xFF;
+  _flash.writeBytes(sectorAddress(dst), hdr, SPIFLASHWL_HEADER);
+
+  setMap(logical, dst);
+  setUsed(dst, true);
+  if (src != _physical) setUsed(src, false);  // its header stays until reused, so its erase count is kept
+  _cursor = (dst + 1) % _physical;
+  _ahead = _physical;
+  prepareAhead();
+  return true;
+}
+
+/// look at one occupied sector, move its data to the spare when it lags far behind in erase count
+/// so that sectors holding data that never changes get back into the rotation
+void SPIFlashWL::staticLevel() {
+  for (uint16_t tries = 0; tries < _physical; tries++) {
+    uint16_t p = _staticCursor;
+    _staticCursor = (_staticCursor + 1) % _physical;
+    if (!isUsed(p)) continue;
+    uint16_t logical;
+    uint32_t count, version;
+    if (readHeader(p, logical, count, version) && count + SPIFLASHWL_STATIC_THRESHOLD < _aheadCount)
+      rewrite(logical, 0, NULL, 0);
+    return;
+  }
+}
+
+/// pick the next free sector after the cursor as the spare and queue its erase
+void SPIFlashWL::prepareAhead() {
+  for (uint16_t tries = 0; tries < _physical; tries++) {
+    uint16_t p = _cursor;
+    _cursor = (_cursor + 1) % _physical;
+    if (isUsed(p)) continue;
+    uint16_t logical;
+    uint32_t count, version;
+    bool stale = readHeader(p, logical, count, version);
+    if (!stale) count = 0;
+    _ahead = p;
+    _aheadCount = count;
+    // a headerless sector is only blank-checked, it may be fresh or hold a torn write
+    if (stale || !_flash.isBlank(sectorAddress(p), SPIFLASHWL_SECTOR)) {
+      _aheadCount++;
+      _aheadToken = _flash.queueBlockErase4K(sectorAddress(p));
+      if (!_aheadToken && _flash.lastError() == SPIFLASH_ERR_QUEUEFULL) _flash.blockErase4K(sectorAddress(p));
+    }
+    return;
+  }
+}
+
+/// read a sector header, returns false if the sector is erased or not a wear-leveling sector
+bool SPIFlashWL::readHeader(uint16_t physical, uint16_t& logical, uint32_t& eraseCount, uint32_t& version) {
+  uint8_t hdr[SPIFLASHWL_HEADER];
+  _flash.readBytes(sectorAddress(physical), hdr, SPIFLASHWL_HEADER);
+  uint32_t magic = hdr[0] | ((uint32_t) hdr[1] << 8) | ((uint32_t) hdr[2] << 16) | ((uint32_t) hdr[3] << 24);
+  logical = hdr[4] | ((uint16_t) hdr[5] << 8);
+  eraseCount = hdr[8] | ((uint32_t) hdr[9] << 8) | ((uint32_t) hdr[10] << 16) | ((uint32_t) hdr[11] << 24);
+  version = hdr[12] | ((uint32_t) hdr[13] << 8) | ((uint32_t) hdr[14] << 16) | ((uint32_t) hdr[15] << 24);
+  return magic == SPIFLASHWL_MAGIC && version != 0xFFFFFFFF;
+}
+
+uint32_t SPIFlashWL::sectorAddress(uint16_t physical) {
+  return _start + (uint32_t) physical * SPIFLASHWL_SECTOR;
+}
+
+uint16_t SPIFlashWL::getMap(uint16_t logical) {
+  uint32_t bit = (uint32_t) logical * _bits;
+  uint16_t value = 0;
+  for (uint8_t i = 0; i < _bits; i++, bit++)
+    if (_map[bit >> 3] & (1 << (bit & 7))) value |= 1 << i;
+  return value;
+}
+
+void SPIFlashWL::setMap(uint16_t logical, uint16_t physical) {
+  uint32_t bit = (uint32_t) logical * _bits;
+  for (uint8_t i = 0; i < _bits; i++, bit++) {
+    if (physical & (1 << i)) _map[bit >> 3] |= 1 << (bit & 7);
+    else _map[bit >> 3] &= ~(1 << (bit & 7));
+  }
+}
+
+bool SPIFlashWL::isUsed(uint16_t physical) {
+  return _used[physical >> 3] & (1 << (physical & 7));
+}
+
+void SPIFlashWL::setUsed(uint16_t physical, bool used) {
+  if (used) _used[physical >> 3] |= 1 << (physical & 7);
+  else _used[physical >> 3] &= ~(1 << (physical & 7));
+}
@@ -0,0 +1,80 @@
+// Wear-leveling block layer on top of SPIFlash
+// **********************************************************************************
+// Maps logical sectors to physical 4K sectors so that repeatedly rewriting the same logical sector
+// spreads the erases over the whole area:
+// - every write goes to a fresh physical sector taken round-robin from the free ones (dynamic leveling),
+//   the sector after it is pre-erased on the SPIFlash non-blocking queue, so a write only costs page programs
+// - every SPIFLASHWL_STATIC_INTERVAL writes, one occupied sector is checked and its (cold) data moved when
+//   it was erased much less often than the sectors in rotation (static leveling)
+// Each physical sector starts with a 16 byte header (logical index, erase count, version), written last,
+// so a write cut by a power failure leaves the previous copy in place. The logical->physical table is
+// rebuilt from the headers at mount and kept bit-packed in a caller-supplied buffer, see bufferSize().
+// A logical sector holds SPIFLASHWL_DATA (4080) bytes.
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHWL_H_
+#define _SPIFLASHWL_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHWL_SECTOR         4096
+#define SPIFLASHWL_MAGIC          0x4C574653  // "SFWL", little endian
+#define SPIFLASHWL_HEADER         16          // magic, logical index, reserved, erase count, version
+#define SPIFLASHWL_DATA           (SPIFLASHWL_SECTOR - SPIFLASHWL_HEADER)
+#define SPIFLASHWL_SPARES         2           // physical sectors not available as logical ones
+#define SPIFLASHWL_CHUNK          64          // stack buffer used when copying a sector
+#define SPIFLASHWL_STATIC_INTERVAL 16         // writes between static leveling checks
+#define SPIFLASHWL_STATIC_THRESHOLD 64        // erase count gap that makes cold data move
+
+class SPIFlashWL {
+public:
+  static uint16_t bufferSize(uint16_t physicalSectors);
+  SPIFlashWL(SPIFlash& flash, uint32_t startAddress, uint16_t physicalSectors, uint8_t* buffer);
+  bool mount();
+  bool format();
+  uint16_t sectors();
+  bool read(uint16_t logical, uint16_t offset, void* buf, uint16_t len);
+  bool write(uint16_t logical, uint16_t offset, const void* buf, uint16_t len);
+  void service();
+  uint16_t physicalSector(uint16_t logical);
+  uint32_t eraseCount(uint16_t physical);
+protected:
+  bool rewrite(uint16_t logical, uint16_t offset, const uint8_t* buf, uint16_t len);
+  void staticLevel();
+  void prepareAhead();
+  bool readHeader(uint16_t physical, uint16_t& logical, uint32_t& eraseCount, uint32_t& version);
+  uint32_t sectorAddress(uint16_t physical);
+  uint16_t getMap(uint16_t logical);
+  void setMap(uint16_t logical, uint16_t physical);
+  bool isUsed(uint16_t physical);
+  void setUsed(uint16_t physical, bool used);
+
+  SPIFlash& _flash;
+  uint32_t _start;
+  uint16_t _physical;
+  uint8_t* _map;            // bit-packed logical->physical table, _physical means unmapped
+  uint8_t* _used;           // one bit per physical sector
+  uint8_t _bits;            // bits per map entry
+  uint32_t _version;
+  uint16_t _cursor;         // round-robin allocation position
+  uint16_t _ahead;          // pre-erased sector the next write goes to
+  uint32_t _aheadCount;     // its erase count
+  uint8_t _aheadToken;      // queued erase of _ahead, 0 when done
+  uint16_t _staticCursor;
+  uint16_t _writes;
+};
+
+#endif
@@ -0,0 +1,221 @@
+// **********************************************************************************
+// This sketch benchmarks the SPIFlash library and the attached flash chip:
+// - erase time per granularity (4K, 32K, 64K)
+// - page program throughput
+// - sequential and random read throughput per transfer size
+// - small write latency percentiles and busy polls per page program
+// Results are printed one per line so they can be collected and compared across boards,
+// clocks, chips and library versions:
+//   bench,<test>,<parameter>,<value>,<unit>
+// Lines starting with '#' describe the setup.
+// WARNING: the BENCH_SIZE bytes starting at BENCH_ADDR are erased and overwritten.
+// Define SPIFLASH_ENABLE_STATS in the build flags to also get the library's own counters.
+// Define SPIFLASH_SIM to run it on a PC against the simulated chip of extras/host (see SPIFlashSim.h).
+// Get the SPIFlash library from here: https://github.com/LowPowerLab/SPIFlash
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+// **********************************************************************************
+#include <SPIFlash.h>    //get it here: https://github.com/LowPowerLab/SPIFlash
+
+#define SERIAL_BAUD      115200
+#define FLASH_CS         SS_FLASHMEM  // chip select pin (8 on Moteino)
+#define FLASH_SPI_HZ     8000000
+#define BENCH_ADDR       0x10000      // 64K aligned start of the scratch area
+#define BENCH_SIZE       0x20000      // scratch area, a multiple of 64K
+#define BENCH_REPEAT     4            // erases timed per granularity
+#define LATENCY_SAMPLES  64           // small writes timed for the percentiles
+#define SMALL_WRITE      16           // bytes per small write
+#define RANDOM_READS     256          // reads per random read test
+#if defined(__AVR__)
+  #define BENCH_BUF      512          // largest transfer size tested (RAM bound)
+#else
+  #define BENCH_BUF      4096
+#endif
+
+#ifdef SPIFLASH_SIM
+#include <SPIFlashSim.h>
+SPIFlashSim sim(NULL, 0x100000);        // 1MB, in RAM, default W25Q timings
+SPIFlash flash(&sim);
+#else
+SPIFlash flash(FLASH_CS, &SPI, SPISettings(FLASH_SPI_HZ, MSBFIRST, SPI_MODE0));
+#endif
+uint8_t buf[BENCH_BUF];
+uint16_t samples[LATENCY_SAMPLES];
+uint32_t rng = 0x12345678;              // fixed seed, every run reads the same addresses
+
+uint32_t nextRandom() {                 // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+void result(const char* test, uint32_t param, uint32_t value, const char* unit) {
+  Serial.print(F("bench,"));
+  Serial.print(test);
+  Serial.print(',');
+  Serial.print(param);
+  Serial.print(',');
+  Serial.print(value);
+  Serial.print(',');
+  Serial.println(unit);
+}
+
+// bytes per second, from a byte count and a duration in microseconds
+uint32_t rate(uint32_t bytes, uint32_t us) {
+  return us ? (uint64_t) bytes * 1000000UL / us : 0;
+}
+
+void benchErase(const char* test, uint8_t sizeLog2) {
+  uint32_t size = 1UL << sizeLog2;
+  uint32_t total = 0, worst = 0;
+  for (uint8_t i = 0; i < BENCH_REPEAT; i++) {
+    uint32_t addr = BENCH_ADDR + (i * size) % BENCH_SIZE;
+    flash.waitReady();
+    uint32_t start = micros();
+    if (sizeLog2 == 12) flash.blockErase4K(addr);
+    else if (sizeLog2 == 15) flash.blockErase32K(addr);
+    else flash.blockErase64K(addr);
+    flash.waitReady();
+    uint32_t us = micros() - start;
+    total += us;
+    if (us > worst) worst = us;
+  }
+  result(test, size, total / BENCH_REPEAT, "us_avg");
+  result(test, size, worst, "us_max");
+}
+
+void benchProgram() {
+  flash.eraseRange(BENCH_ADDR, BENCH_SIZE);
+  flash.waitReady();
+  for (uint16_t i = 0; i < BENCH_BUF; i++) buf[i] = i;
+  uint32_t start = micros();
+  for (uint32_t addr = BENCH_ADDR; addr < BENCH_ADDR + BENCH_SIZE; addr += BENCH_BUF)
+    flash.writeBytes(addr, buf, BENCH_BUF);
+  flash.waitReady();
+  result("program", 256, rate(BENCH_SIZE, micros() - start), "B/s");
+
+  // single page program: time until the chip is ready again and how many status reads that took
+  flash.eraseRange(BENCH_ADDR, 4096);
+  flash.waitReady();
+  uint32_t polls = 0;
+  start = micros();
+  flash.writeBytes(BENCH_ADDR, buf, 256);
+  while (flash.busy()) polls++;
+  result("page_program", 256, micros() - start, "us");
+  result("page_program_polls", 256, polls, "count");
+}
+
+void benchSequentialRead(uint16_t size) {
+  uint32_t bytes = 0;
+  uint32_t start = micros();
+  for (uint32_t addr = BENCH_ADDR; addr + size <= BENCH_ADDR + BENCH_SIZE && bytes < 65536UL; addr += size) {
+    flash.readBytes(addr, buf, size);
+    bytes += size;
+  }
+  result("seq_read", size, rate(bytes, micros() - start), "B/s");
+}
+
+void benchRandomRead(uint16_t size) {
+  uint32_t start = micros();
+  for (uint16_t i = 0; i < RANDOM_READS; i++)
+    flash.readBytes(BENCH_ADDR + nextRandom() % (BENCH_SIZE - size), buf, size);
+  uint32_t us = micros() - start;
+  result("rand_read", size, rate((uint32_t) size * RANDOM_READS, us), "B/s");
+  result("rand_read_latency", size, us / RANDOM_READS, "us_avg");
+}
+
+// each write is timed until the chip is ready again, so the samples are the real cost of a small update
+void benchSmallWrites() {
+  flash.eraseRange(BENCH_ADDR, BENCH_SIZE);
+  flash.waitReady();
+  uint32_t addr = BENCH_ADDR;
+  for (uint16_t i = 0; i < LATENCY_SAMPLES; i++) {
+    uint32_t start = micros();
+    flash.writeBytes(addr, buf, SMALL_WRITE);
+    flash.waitReady();
+    uint32_t us = micros() - start;
+    samples[i] = us > 0xFFFF ? 0xFFFF : us;
+    addr += SMALL_WRITE;
+  }
+  // insertion sort, the sample count is small
+  for (uint16_t i = 1; i < LATENCY_SAMPLES; i++) {
+    uint16_t v = samples[i];
+    int16_t j = i - 1;
+    while (j >= 0 && samples[j] > v) {
+      samples[j+1] = samples[j];
+      j--;
+    }
+    samples[j+1] = v;
+  }
+  result("small_write_p50", SMALL_WRITE, samples[LATENCY_SAMPLES / 2], "us");
+  result("small_write_p90", SMALL_WRITE, samples[LATENCY_SAMPLES * 9 / 10], "us");
+  result("small_write_p99", SMALL_WRITE, samples[LATENCY_SAMPLES * 99 / 100], "us");
+  result("small_write_max", SMALL_WRITE, samples[LATENCY_SAMPLES - 1], "us");
+}
+
+#ifdef SPIFLASH_ENABLE_STATS
+void printStats() {
+  const SPIFlashStats& s = flash.getStats();
+  result("stats_bytes_read", 0, s.bytesRead, "B");
+  result("stats_bytes_written", 0, s.bytesWritten, "B");
+  result("stats_page_programs", 0, s.pagePrograms, "count");
+  result("stats_busy_polls", 0, s.busyPolls, "count");
+  result("stats_wait", 0, s.waitUs, "us");
+  result("stats_wait_max", 0, s.waitMaxUs, "us");
+  result("stats_transactions", 0, s.transactions, "count");
+  result("stats_transaction", 0, s.transactionUs, "us");
+}
+#endif
+
+void setup(){
+  Serial.begin(SERIAL_BAUD);
+  while (!Serial) delay(100); //wait until Serial/monitor is opened
+
+  //ensure the radio module CS pin is pulled HIGH or it might interfere!
+  pinMode(SS, OUTPUT); digitalWrite(SS, HIGH);
+
+  if (!flash.initialize()) {
+    Serial.println(F("# SPI Flash Init FAIL! (is chip soldered?)"));
+    return;
+  }
+  const SPIFlashInfo& info = flash.chipInfo();
+  Serial.print(F("# F_CPU=")); Serial.println(F_CPU);
+  Serial.print(F("# spi_hz=")); Serial.println(FLASH_SPI_HZ);
+  Serial.print(F("# jedec=")); Serial.println(info.jedecID, HEX);
+  Serial.print(F("# capacity=")); Serial.println(info.capacity);
+  Serial.print(F("# sfdp=")); Serial.println(info.sfdp);
+#ifdef SPIFLASH_SIM
+  sim.setClock(FLASH_SPI_HZ);
+#endif
+
+  benchErase("erase", 12);
+  benchErase("erase", 15);
+  benchErase("erase", 16);
+  benchProgram();
+  for (uint16_t size = 1; size <= BENCH_BUF; size <<= 2) benchSequentialRead(size);
+  for (uint16_t size = 1; size <= BENCH_BUF; size <<= 2) benchRandomRead(size);
+  benchSmallWrites();
+#ifdef SPIFLASH_ENABLE_STATS
+  printStats();
+#endif
+#ifdef SPIFLASH_SIM
+  Serial.print(F("# sim_violations=")); Serial.println(sim.violations());
+#endif
+  Serial.println(F("# done"));
+}
+
+void loop(){
+}
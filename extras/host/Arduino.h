@@ -0,0 +1,120 @@
+// Minimal Arduino core for building SPIFlash and its sketches on a PC (see SPIFlashSim.h)
+// **********************************************************************************
+// Time is simulated: micros()/millis() only move forward when the simulated flash clocks bytes
+// (SPIFlashSim::setClock), on delay()/delayMicroseconds() and by 1us on each yield(), so results are
+// deterministic and a run takes host time, not flash time.
+// Serial prints to stdout.
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASH_HOST_ARDUINO_H_
+#define _SPIFLASH_HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPIFLASH_HOST             1
+
+#define HIGH                      1
+#define LOW                       0
+#define INPUT                     0
+#define OUTPUT                    1
+#define DEC                       10
+#define HEX                       16
+#define SS                        10
+#define SS_FLASHMEM               8
+#ifndef F_CPU
+  #define F_CPU                   16000000UL
+#endif
+#define F(s)                      (s)
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+void hostElapse(uint64_t ns);   // advance the simulated clock
+uint64_t hostNanos();
+
+inline unsigned long micros() { return (unsigned long) (hostNanos() / 1000); }
+inline unsigned long millis() { return (unsigned long) (hostNanos() / 1000000); }
+inline void delayMicroseconds(unsigned int us) { hostElapse((uint64_t) us * 1000); }
+inline void delay(unsigned long ms) { hostElapse((uint64_t) ms * 1000000); }
+inline void yield() { hostElapse(1000); }
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return HIGH; }
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t len) {
+    size_t n = 0;
+    while (len--) n += write(*buf++);
+    return n;
+  }
+  size_t print(const char* s) { return write((const uint8_t*) s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(unsigned long v, int base=DEC) { return number(v, base, false); }
+  size_t print(long v, int base=DEC) { return number(v, base, true); }
+  size_t print(unsigned int v, int base=DEC) { return number(v, base, false); }
+  size_t print(int v, int base=DEC) { return number(v, base, true); }
+  size_t print(unsigned char v, int base=DEC) { return number(v, base, false); }
+  size_t print(double v, int digits=2) {
+    char s[40];
+    snprintf(s, sizeof(s), "%.*f", digits, v);
+    return print(s);
+  }
+  size_t println() { return print("\r\n"); }
+  template<typename T> size_t println(T v) { return print(v) + println(); }
+  template<typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+protected:
+  size_t number(long long v, int base, bool isSigned) {
+    char s[24];
+    if (base == HEX) snprintf(s, sizeof(s), "%llX", (unsigned long long) (isSigned ? v : (unsigned long) v));
+    else if (isSigned) snprintf(s, sizeof(s), "%lld", v);
+    else snprintf(s, sizeof(s), "%llu", (unsigned long long) v);
+    return print(s);
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  size_t readBytes(uint8_t* buf, size_t len) {
+    size_t n = 0;
+    while (n < len && available()) buf[n++] = read();
+    return n;
+  }
+  size_t readBytes(char* buf, size_t len) { return readBytes((uint8_t*) buf, len); }
+};
+
+class HostSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+  size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+};
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,43 @@
+// Placeholder SPI library for host builds, the flash is reached through SPIFlashSim (a SPIFlashBus)
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASH_HOST_SPI_H_
+#define _SPIFLASH_HOST_SPI_H_
+
+#include <Arduino.h>
+
+#define SPI_HAS_TRANSACTION       1
+#define MSBFIRST                  1
+#define SPI_MODE0                 0
+
+class SPISettings {
+public:
+  SPISettings() {}
+  SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass {
+public:
+  void begin() {}
+  void end() {}
+  void beginTransaction(SPISettings) {}
+  void endTransaction() {}
+  uint8_t transfer(uint8_t) { return 0xFF; }
+  void transfer(void* buf, size_t len) { memset(buf, 0xFF, len); }
+};
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,295 @@
+// Simulated SPI NOR flash for running SPIFlash and the layers on top of it on a PC
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashSim.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Constructor. path is the backing file, created (erased) or grown to capacity as needed; NULL keeps the array in RAM
+/// capacity must be a power of 2 of at least 64K, the JEDEC ID reports it (see setJedecID)
+SPIFlashSim::SPIFlashSim(const char* path, uint32_t capacity) {
+  _mem = NULL;
+  _capacity = capacity;
+  _fd = -1;
+  uint8_t density = 0;
+  while ((1UL << density) < capacity) density++;
+  _jedecID = 0xEF4000UL | density;
+  setClock(SPIFLASHSIM_CLOCK_HZ);
+  setTiming(SPIFLASHSIM_TPP_US, SPIFLASHSIM_TSE_US, SPIFLASHSIM_TBE32_US, SPIFLASHSIM_TBE64_US, SPIFLASHSIM_TCE_US);
+  _busyUntil = 0;
+  _suspendedLeft = 0;
+  _wakingUntil = 0;
+  _sr2 = _sr2Write = 0;
+  memset(_security, 0xFF, sizeof(_security));
+  _sfdp = NULL;
+  _sfdpLen = 0;
+  _wel = _sleeping = _addr4 = _selected = _erasing = false;
+  _cmd = 0;
+  _violations = _pagePrograms = _erases = 0;
+
+  off_t erasedFrom = 0;
+  void* mem;
+  if (path) {
+    struct stat st;
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0 || fstat(_fd, &st)) return;
+    erasedFrom = st.st_size < (off_t) capacity ? st.st_size : capacity;
+    if (st.st_size < (off_t) capacity && ftruncate(_fd, capacity)) return;
+    mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  }
+  else mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return;
+  _mem = (uint8_t*) mem;
+  memset(_mem + erasedFrom, 0xFF, capacity - erasedFrom);
+}
+
+SPIFlashSim::~SPIFlashSim() {
+  if (_mem) munmap(_mem, _capacity);
+  if (_fd >= 0) close(_fd);
+}
+
+/// false if the backing file could not be opened or mapped
+bool SPIFlashSim::ok() {
+  return _mem != NULL;
+}
+
+/// the flash array, for inspecting or preloading it directly
+uint8_t* SPIFlashSim::data() {
+  return _mem;
+}
+
+uint32_t SPIFlashSim::capacity() {
+  return _capacity;
+}
+
+/// JEDEC ID returned by 0x9F, default 0xEF40xx (Winbond W25Q) with xx = log2(capacity)
+void SPIFlashSim::setJedecID(uint32_t jedecID) {
+  _jedecID = jedecID;
+}
+
+/// SPI clock, each byte transferred advances the simulated time by 8 clock periods
+void SPIFlashSim::setClock(uint32_t hz) {
+  _byteNs = 8000000000ULL / hz;
+}
+
+/// page program, 4K sector, 32K and 64K block and chip erase times in microseconds
+void SPIFlashSim::setTiming(uint32_t tPPus, uint32_t tSEus, uint32_t tBE32us, uint32_t tBE64us, uint32_t tCEus) {
+  _tPP = tPPus;
+  _tSE = tSEus;
+  _tBE32 = tBE32us;
+  _tBE64 = tBE64us;
+  _tCE = tCEus;
+}
+
+/// SFDP address space read by 0x5A (signature, parameter headers, tables), kept by the caller; NULL removes it
+void SPIFlashSim::setSFDP(const uint8_t* table, uint16_t len) {
+  _sfdp = table;
+  _sfdpLen = table ? len : 0;
+}
+
+/// commands the chip would have ignored or corrupted: sent while busy or asleep, program/erase without WEL
+uint32_t SPIFlashSim::violations() {
+  return _violations;
+}
+
+/// true while the chip is in 4-byte address mode (B7h)
+bool SPIFlashSim::addr4() {
+  return _addr4;
+}
+
+uint32_t SPIFlashSim::pagePrograms() {
+  return _pagePrograms;
+}
+
+uint32_t SPIFlashSim::erases() {
+  return _erases;
+}
+
+void SPIFlashSim::select() {
+  _selected = true;
+  _cmd = 0;
+  _index = 0;
+  _addr = 0;
+}
+
+void SPIFlashSim::unselect() {
+  if (_selected && _cmd && _cmd != 0xFF) finish();
+  _selected = false;
+}
+
+uint8_t SPIFlashSim::transfer(uint8_t data) {
+  hostElapse(_byteNs);
+  if (!_selected) return 0xFF;
+  if (_cmd) return _cmd == 0xFF ? 0xFF : dataByte(data);
+  _cmd = acceptCommand(data) ? data : 0xFF;
+  _addrLen = _dummy = 0;
+  switch (_cmd) {
+    case 0x03: case 0x0B: case 0x02: case 0x20: case 0x52: case 0xD8: case 0x48: case 0x42: case 0x44:
+      _addrLen = _addr4 ? 4 : 3;
+      break;
+    case 0x13: case 0x0C: case 0x12: case 0x21: case 0x5C: case 0xDC:
+      _addrLen = 4;
+      break;
+    case 0x5A:
+      _addrLen = 3;
+      break;
+    case 0x4B:
+      _dummy = 4;
+      break;
+    case 0xAB:
+      _dummy = 3;
+      break;
+  }
+  if (_cmd == 0x0B || _cmd == 0x0C || _cmd == 0x5A || _cmd == 0x48) _dummy = 1;
+  if (_cmd == 0x01 || _cmd == 0x31) _sr2Write = _sr2;
+  return 0xFF;
+}
+
+/// security register (0..2) of the current command's address, 3 or more when it names none
+uint8_t SPIFlashSim::securityRegister() {
+  uint32_t reg = (_addr >> 12) - 1;
+  return reg < 3 ? reg : 3;
+}
+
+bool SPIFlashSim::busy() {
+  if (hostNanos() < _busyUntil) return true;
+  if (!_suspendedLeft) _erasing = false;
+  return false;
+}
+
+void SPIFlashSim::startBusy(uint32_t us) {
+  _busyUntil = hostNanos() + (uint64_t) us * 1000;
+  _wel = false;
+}
+
+/// whether the chip would act on opcode cmd in its current state
+bool SPIFlashSim::acceptCommand(uint8_t cmd) {
+  bool ok = true;
+  if (_sleeping) ok = cmd == 0xAB;
+  else if (hostNanos() < _wakingUntil) ok = false;
+  else if (busy()) ok = cmd == 0x05 || cmd == 0x35 || (cmd == 0x75 && _erasing && !_suspendedLeft);
+  else switch (cmd) {
+    case 0x20: case 0x52: case 0xD8: case 0x21: case 0x5C: case 0xDC: case 0x60: case 0xC7: case 0x44:
+      ok = _wel && !_suspendedLeft;
+      break;
+    case 0x02: case 0x12: case 0x01: case 0x31: case 0x42:
+      ok = _wel;
+      break;
+  }
+  if (!ok) _violations++;
+  return ok;
+}
+
+uint8_t SPIFlashSim::dataByte(uint8_t in) {
+  uint32_t i = _index++;
+  switch (_cmd) {
+    case 0x05:
+      return (busy() ? 0x01 : 0) | (_wel ? 0x02 : 0);
+    case 0x35:
+      return (_suspendedLeft ? 0x80 : 0) | _sr2;  // SUS bit, lock bits
+    case 0x01:
+      if (i == 1) _sr2Write = in;
+      return 0xFF;
+    case 0x31:
+      if (i == 0) _sr2Write = in;
+      return 0xFF;
+    case 0x9F:
+      return _jedecID >> (16 - 8 * (i % 3));
+    case 0xAB:
+      return i < _dummy ? 0xFF : (_jedecID & 0xFF) - 1;
+    case 0x4B:
+      return i < _dummy ? 0xFF : 0xA0 + (i - _dummy) % 8;
+  }
+  if (i < _addrLen) {
+    _addr = (_addr << 8) | in;
+    return 0xFF;
+  }
+  if (!_addrLen || i < (uint32_t) _addrLen + _dummy) return 0xFF;
+  uint32_t n = i - _addrLen - _dummy;
+  switch (_cmd) {
+    case 0x03: case 0x0B: case 0x13: case 0x0C:
+      return _mem[(_addr + n) % _capacity];
+    case 0x5A:
+      return _addr + n < _sfdpLen ? _sfdp[_addr + n] : 0xFF;
+    case 0x48:
+      return securityRegister() < 3 ? _security[securityRegister()][(_addr + n) & 0xFF] : 0xFF;
+    case 0x02: case 0x12: case 0x42:
+      if (!n) memset(_page, 0xFF, sizeof(_page));
+      _page[(_addr + n) & 0xFF] = in;  // wraps within the page like the real latch
+      break;
+  }
+  return 0xFF;
+}
+
+/// act on the command when chip select goes high, as the chip does
+void SPIFlashSim::finish() {
+  bool addressed = _index >= _addrLen;
+  uint32_t addr = _addr % _capacity;
+  uint32_t size = 0, us = 0;
+  switch (_cmd) {
+    case 0x06: _wel = true; break;
+    case 0x04: _wel = false; break;
+    case 0x01: case 0x31:
+      _sr2 |= _sr2Write & 0x38;  // one-time programmable
+      _wel = false;
+      break;
+    case 0xB9: _sleeping = true; break;
+    case 0xAB:
+      if (_sleeping) _wakingUntil = hostNanos() + SPIFLASHSIM_TRES1_US * 1000;
+      _sleeping = false;
+      break;
+    case 0xB7: _addr4 = true; break;
+    case 0xE9: _addr4 = false; break;
+    case 0x02: case 0x12:
+      if (_index <= _addrLen) break;
+      addr &= ~0xFFUL;
+      for (uint16_t i = 0; i < 256; i++) _mem[addr + i] &= _page[i];
+      _pagePrograms++;
+      startBusy(_tPP);
+      break;
+    case 0x42: case 0x44:
+      if (_index < _addrLen || (_cmd == 0x42 && _index == _addrLen)) break;
+      if (securityRegister() < 3 && !(_sr2 & (0x08 << securityRegister()))) {
+        uint8_t* reg = _security[securityRegister()];
+        for (uint16_t i = 0; i < 256; i++) reg[i] = _cmd == 0x44 ? 0xFF : reg[i] & _page[i];
+      }
+      startBusy(_cmd == 0x44 ? _tSE : _tPP);
+      break;
+    case 0x20: case 0x21: size = 0x1000; us = _tSE; break;
+    case 0x52: case 0x5C: size = 0x8000; us = _tBE32; break;
+    case 0xD8: case 0xDC: size = 0x10000; us = _tBE64; break;
+    case 0x60: case 0xC7: size = _capacity; us = _tCE; addr = 0; addressed = true; break;
+    case 0x75:
+      if (_busyUntil <= hostNanos()) break;
+      _suspendedLeft = _busyUntil - hostNanos();
+      _busyUntil = hostNanos() + SPIFLASHSIM_TSUS_US * 1000;
+      break;
+    case 0x7A:
+      if (!_suspendedLeft) break;
+      _busyUntil = hostNanos() + _suspendedLeft;
+      _suspendedLeft = 0;
+      break;
+  }
+  if (size && addressed) {
+    addr &= ~(size - 1);
+    memset(_mem + addr, 0xFF, size);
+    _erases++;
+    _erasing = true;
+    startBusy(us);
+  }
+}
@@ -0,0 +1,100 @@
+// Simulated SPI NOR flash for running SPIFlash and the layers on top of it on a PC
+// **********************************************************************************
+// SPIFlashSim is a SPIFlashBus, pass it to SPIFlash(SPIFlashBus*) instead of a chip select pin.
+// The array lives in a file mapped with mmap (or in RAM when path is NULL), so a run can be inspected
+// or resumed. The device behaves like a Winbond W25Q part:
+// - page program only clears bits (1->0) and wraps around within the 256 byte page
+// - program/erase need a write enable, keep the chip busy for the configured tPP/tSE/tBE/tCE and
+//   then clear WEL
+// - erase suspend/resume (0x75/0x7A), deep power down, 4-byte address mode
+// - an optional SFDP table (setSFDP), without one 0x5A reads an invalid signature
+// - 3 security registers of 256 bytes (0x48/0x42/0x44, kept in RAM) and their one-time lock bits in
+//   status register 2
+// - commands other than status reads sent while busy, in deep power down or within tRES1 of the wake
+//   up, or program/erase without WEL are ignored and counted in violations()
+// Bytes are clocked at setClock() Hz on the simulated time of the host Arduino.h, so micros() based
+// figures (ie. from the SPIFlash_Benchmark sketch) model a real board with that SPI clock.
+//
+// Build a sketch on the host, ie. the benchmark:
+//   g++ -O2 -DARDUINO=10813 -DSPIFLASH_SIM -DSPIFLASH_HOST_MAIN -Iextras/host -I. -o bench
+//     -x c++ examples/SPIFlash_Benchmark/SPIFlash_Benchmark.ino -x none extras/host/*.cpp SPIFlash*.cpp
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#ifndef _SPIFLASHSIM_H_
+#define _SPIFLASHSIM_H_
+
+#include <SPIFlash.h>
+
+#define SPIFLASHSIM_CLOCK_HZ      8000000     // default SPI clock
+#define SPIFLASHSIM_TPP_US        400         // default timings, typical W25Q values
+#define SPIFLASHSIM_TSE_US        45000
+#define SPIFLASHSIM_TBE32_US      120000
+#define SPIFLASHSIM_TBE64_US      150000
+#define SPIFLASHSIM_TCE_US        5000000
+#define SPIFLASHSIM_TSUS_US       20
+#define SPIFLASHSIM_TRES1_US      3           // wake up to the next accepted command
+
+class SPIFlashSim : public SPIFlashBus {
+public:
+  SPIFlashSim(const char* path, uint32_t capacity);
+  ~SPIFlashSim();
+  bool ok();
+  uint8_t* data();
+  uint32_t capacity();
+  void setJedecID(uint32_t jedecID);
+  void setClock(uint32_t hz);
+  void setTiming(uint32_t tPPus, uint32_t tSEus, uint32_t tBE32us, uint32_t tBE64us, uint32_t tCEus);
+  void setSFDP(const uint8_t* table, uint16_t len);
+  uint32_t violations();
+  bool addr4();
+  uint32_t pagePrograms();
+  uint32_t erases();
+
+  void select();
+  void unselect();
+  uint8_t transfer(uint8_t data);
+protected:
+  bool busy();
+  void startBusy(uint32_t us);
+  bool acceptCommand(uint8_t cmd);
+  uint8_t dataByte(uint8_t in);
+  uint8_t securityRegister();
+  void finish();
+
+  uint8_t* _mem;
+  uint32_t _capacity;
+  int _fd;
+  uint32_t _jedecID;
+  uint32_t _byteNs;
+  uint32_t _tPP, _tSE, _tBE32, _tBE64, _tCE;
+  uint64_t _busyUntil;       // simulated ns
+  uint64_t _suspendedLeft;   // ns of erase left while suspended, 0 when not suspended
+  uint64_t _wakingUntil;     // simulated ns, end of tRES1 after a wake up
+  bool _wel, _sleeping, _addr4, _selected, _erasing;
+  uint8_t _cmd;              // current command, 0 = none yet, 0xFF = ignored
+  uint8_t _addrLen, _dummy;
+  uint32_t _index;           // bytes received after the opcode
+  uint32_t _addr;
+  uint8_t _page[256];        // page program latch, applied on unselect
+  uint8_t _security[3][256];
+  const uint8_t* _sfdp;      // caller-owned SFDP address space, NULL when the chip has none
+  uint16_t _sfdpLen;
+  uint8_t _sr2;              // security register lock bits LB1..LB3 (0x38), never cleared
+  uint8_t _sr2Write;         // value of the status register 2 write in progress
+  uint32_t _violations, _pagePrograms, _erases;
+};
+
+#endif
@@ -0,0 +1,47 @@
+// Simulated clock, Serial and optional main() of the host Arduino core (see Arduino.h)
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#ifndef SPIFLASH_HOST_LOOPS
+  #define SPIFLASH_HOST_LOOPS     1           // loop() calls before main() returns
+#endif
+
+HostSerial Serial;
+SPIClass SPI;
+static uint64_t now;
+
+void hostElapse(uint64_t ns) {
+  now += ns;
+}
+
+uint64_t hostNanos() {
+  return now;
+}
+
+#ifdef SPIFLASH_HOST_MAIN
+void setup();
+void loop();
+
+/// run a sketch: setup() then loop() SPIFLASH_HOST_LOOPS times
+int main() {
+  setup();
+  for (uint32_t i = 0; i < SPIFLASH_HOST_LOOPS; i++) loop();
+  fflush(stdout);
+  return 0;
+}
+#endif
@@ -0,0 +1,51 @@
+// A chip stuck busy past the hard timeout: every call gives up without sending a command to it
+// **********************************************************************************
+// Build and run on the host:
+//   g++ -O1 -DARDUINO=10813 -Iextras/host -I. -o busy_timeout extras/host/tests/BusyTimeout.cpp
+//     extras/host/*.cpp SPIFlash.cpp && ./busy_timeout
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashSim.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define SCRATCH     0x80000
+
+int main() {
+  SPIFlashSim sim(NULL, 0x100000);
+  SPIFlash flash(&sim);
+  assert(flash.initialize());
+  assert(flash.setUpdateScratch(SCRATCH));
+  sim.setTiming(400, 10000000, 10000000, 10000000, 10000000);  // 10s erases
+  SPIFlashTiming timing = { 700, 10, 10, 10, 10, 1000, 2 };     // given up after 20ms
+  flash.setTiming(timing);
+
+  uint8_t buf[300];
+  memset(buf, 0, sizeof(buf));
+  flash.blockErase4K(0x1000);
+  flash.writeBytes(0x1000, buf, sizeof(buf));                  // into the erasing sector, so it has to wait
+  assert(flash.lastError() == SPIFLASH_ERR_TIMEOUT);
+  flash.readBytes(0x1000, buf, sizeof(buf));
+  assert(buf[0] == 0xFF && buf[sizeof(buf) - 1] == 0xFF);
+  assert(!flash.compare(0x1000, buf, 16));
+  assert(!flash.update(0x30000, buf, 16));
+  assert(flash.readJedecId() == 0);
+
+  printf("violations %u\n", sim.violations());
+  assert(sim.violations() == 0);
+  puts("OK");
+  return 0;
+}
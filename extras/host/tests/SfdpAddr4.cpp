@@ -0,0 +1,95 @@
+// SFDP DW16 on a 256Mbit chip: B7h is only sent when DW16 lists it, otherwise the 4-byte opcodes are used
+// **********************************************************************************
+// Build and run on the host:
+//   g++ -O1 -DARDUINO=10813 -Iextras/host -I. -o sfdp_addr4 extras/host/tests/SfdpAddr4.cpp
+//     extras/host/*.cpp SPIFlash.cpp && ./sfdp_addr4
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashSim.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define BFPT        0x80
+#define CAPACITY    0x2000000UL   // 256Mbit
+#define TESTADDR    0x1400000UL   // above 16MB
+
+static uint8_t sfdp[BFPT + 64];
+
+// Basic Flash Parameter Table with 3- or 4-byte addresses, the given density (DW2) and 4-byte entry methods (DW16 31:24)
+static void makeTable(uint32_t density, uint8_t enter4) {
+  const uint32_t bfpt[16] = {
+    0xFFFB20E5,   // DW1: 3- or 4-byte addresses, 1-1-2, 1-2-2, 1-4-4, 1-1-4 reads
+    density,
+    0x6B08EB44, 0xBB423B08, 0xFFFFFFEE, 0xFF00FFFF, 0xFF00FFFF,
+    0x520F200C,   // DW8: 4K 20h, 32K 52h
+    0xFF00D810,   // DW9: 64K D8h
+    0x3 | (0x2CUL << 4) | (0x27UL << 11) | (0x29UL << 18),
+    0x3 | (8UL << 4) | (6UL << 8) | (1UL << 13) | ((2UL << 5) << 24),
+    0, 0, 0,
+    4UL << 20,
+    (uint32_t) enter4 << 24
+  };
+  memset(sfdp, 0xFF, sizeof(sfdp));
+  const uint8_t header[16] = { 'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+                               0x00, 0x06, 0x01, 16, BFPT, 0x00, 0x00, 0xFF };
+  memcpy(sfdp, header, sizeof(header));
+  for (uint8_t i = 0; i < 16; i++)
+    for (uint8_t b = 0; b < 4; b++) sfdp[BFPT + 4 * i + b] = bfpt[i] >> (8 * b);
+}
+
+// initialize with DW16 = enter4, check whether the chip was switched with B7h, and that the high addresses work
+static void check(SPIFlashSim& sim, uint8_t enter4, bool expectB7) {
+  makeTable(0x80000000UL | 28, enter4);
+  SPIFlash flash(&sim);
+  assert(flash.initialize());
+  assert(flash.chipInfo().capacity == CAPACITY && flash.chipInfo().addressBytes == 4);
+  assert(sim.addr4() == expectB7);
+  flash.blockErase4K(TESTADDR);
+  flash.writeByte(TESTADDR + 1, 0x42);
+  assert(flash.readByte(TESTADDR + 1) == 0x42);
+  assert(sim.data()[TESTADDR + 1] == 0x42 && sim.data()[(TESTADDR + 1) & 0xFFFFFF] == 0xFF);
+  flash.blockErase4K(TESTADDR);
+  printf("DW16 enter %02X: B7h %s\n", enter4, expectB7 ? "sent" : "not sent");
+}
+
+int main() {
+  {
+    SPIFlashSim sim(NULL, CAPACITY);
+    sim.setSFDP(sfdp, sizeof(sfdp));
+    check(sim, 0x01, true);     // B7h
+  }
+  {
+    SPIFlashSim sim(NULL, CAPACITY);
+    sim.setSFDP(sfdp, sizeof(sfdp));
+    check(sim, 0x02, true);     // WREN, B7h
+  }
+  {
+    SPIFlashSim sim(NULL, CAPACITY);
+    sim.setSFDP(sfdp, sizeof(sfdp));
+    check(sim, 0x0C, false);    // extended address / bank register only: 4-byte opcodes instead
+    assert(sim.violations() == 0);
+  }
+
+  // a density under a byte (2^2 bits) is bogus: capacity unknown
+  SPIFlashSim sim(NULL, 0x100000);
+  makeTable(0x80000002UL, 0);
+  sim.setSFDP(sfdp, sizeof(sfdp));
+  SPIFlash flash(&sim);
+  flash.initialize();
+  assert(flash.chipInfo().capacity == 0);
+  puts("OK");
+  return 0;
+}
@@ -0,0 +1,79 @@
+// SFDP parsing against the simulator: a W25Q80-like table, then an erase suspended by a read
+// **********************************************************************************
+// Build and run on the host:
+//   g++ -O1 -DARDUINO=10813 -Iextras/host -I. -o sfdp_suspend extras/host/tests/SfdpSuspend.cpp
+//     extras/host/*.cpp SPIFlash.cpp && ./sfdp_suspend
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashSim.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define BFPT        0x80
+
+// Basic Flash Parameter Table, 8Mbit, timings close to the simulator defaults
+static const uint32_t bfpt[16] = {
+  0xFFF920E5,   // DW1: 3-byte addresses, 1-1-2, 1-2-2, 1-4-4, 1-1-4 reads
+  0x007FFFFF,   // DW2: 8Mbit
+  0x6B08EB44,   // DW3: 1-4-4 EBh 4+2 clocks, 1-1-4 6Bh 8 clocks
+  0xBB423B08,   // DW4: 1-1-2 3Bh 8 clocks, 1-2-2 BBh 2+2 clocks
+  0xFFFFFFEE, 0xFF00FFFF, 0xFF00FFFF,
+  0x520F200C,   // DW8: 4K 20h, 32K 52h
+  0xFF00D810,   // DW9: 64K D8h
+  0x3 | (0x2CUL << 4) | (0x27UL << 11) | (0x29UL << 18),             // DW10: 45ms, 128ms, 160ms, max x8
+  0x3 | (8UL << 4) | (6UL << 8) | (1UL << 13) | ((2UL << 5) << 24),  // DW11: 256 byte pages, 448us, 4s, max x8
+  (19UL | (1UL << 5)) << 24,                                          // DW12: erase suspend in 20us
+  0x757A757A,   // DW13: erase suspend 75h, erase resume 7Ah, program suspend 75h, program resume 7Ah
+  (0xB9UL << 23) | (0xABUL << 15) | ((2UL | (1UL << 5)) << 8),       // DW14: deep power down, 3us exit
+  4UL << 20,    // DW15: QE is bit 1 of status register 2
+  0
+};
+
+int main() {
+  uint8_t sfdp[BFPT + sizeof(bfpt)];
+  memset(sfdp, 0xFF, sizeof(sfdp));
+  const uint8_t header[16] = { 'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,  // one parameter header
+                               0x00, 0x06, 0x01, 16, BFPT, 0x00, 0x00, 0xFF };
+  memcpy(sfdp, header, sizeof(header));
+  for (uint8_t i = 0; i < 16; i++)
+    for (uint8_t b = 0; b < 4; b++) sfdp[BFPT + 4 * i + b] = bfpt[i] >> (8 * b);
+
+  SPIFlashSim sim(NULL, 0x100000);
+  sim.setSFDP(sfdp, sizeof(sfdp));
+  SPIFlash flash(&sim);
+  assert(flash.initialize());
+  const SPIFlashInfo& info = flash.chipInfo();
+  assert(info.sfdp);
+  assert(info.capacity == 0x100000 && info.pageSize == 256 && info.addressBytes == 3);
+  assert(info.suspendOpcode == 0x75 && info.resumeOpcode == 0x7A);
+  assert(info.eraseSizeLog2[0] == 12 && info.eraseOpcode[0] == 0x20);
+  assert(info.wakeLatencyUs == 3);
+
+  // a read in the middle of a 4K erase suspends and resumes it, the erase then completes
+  flash.writeByte(0x10, 0x42);
+  flash.writeByte(0x2000, 0x24);
+  flash.blockErase4K(0);
+  delay(5);
+  assert(flash.readByte(0x2000) == 0x24);
+  assert(flash.waitReady());
+  assert(flash.readByte(0x10) == 0xFF);
+  flash.writeByte(0x10, 0x42);
+  assert(flash.readByte(0x10) == 0x42);
+  printf("violations: %u\n", sim.violations());
+  assert(sim.violations() == 0);
+  puts("OK");
+  return 0;
+}
@@ -0,0 +1,60 @@
+// update() with the read cache enabled: every erase-needing rewrite gets its own complete journal record
+// **********************************************************************************
+// Build and run on the host:
+//   g++ -O1 -DARDUINO=10813 -Iextras/host -I. -o update_cache extras/host/tests/UpdateReadCache.cpp
+//     extras/host/*.cpp SPIFlash.cpp && ./update_cache
+// **********************************************************************************
+// License
+// **********************************************************************************
+// This program is free software; you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Licence can be viewed at
+// http://www.gnu.org/licenses/gpl-3.0.txt
+//
+// Please maintain this license information along with authorship
+// and copyright notices in any redistribution of this code
+
+#include <SPIFlashSim.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define SCRATCH     0x80000
+
+int main() {
+  SPIFlashSim sim(NULL, 0x100000);
+  SPIFlash flash(&sim);
+  assert(flash.initialize());
+  SPIFlashCacheLine lines[4];
+  uint8_t lineData[4 * 32];
+  flash.setReadCache(lines, 4, lineData, 32);
+  assert(flash.setUpdateScratch(SCRATCH));
+
+  uint8_t buf[64], back[64];
+  for (uint8_t k = 0; k < 4; k++) {
+    uint32_t addr = 0x1000UL * (k + 1);
+    for (uint8_t i = 0; i < 64; i++) buf[i] = i + k;
+    assert(flash.update(addr, buf, 64));          // blank sector: programmed in place
+    assert(flash.update(addr, buf + 1, 63));      // sets bits: goes through the scratch and the journal
+    flash.readBytes(addr, back, 32);
+    assert(!memcmp(back, buf + 1, 32));
+  }
+
+  // four records, each done and with a CRC matching the scratch copy of its own rewrite
+  const uint8_t* record = sim.data() + SCRATCH + 0x1000;
+  uint8_t records = 0;
+  while (record[0] != 0xFF || record[1] != 0xFF || record[2] != 0xFF || record[3] != 0xFF) {
+    assert(record[12] == 0);
+    assert(record[4] == 0 && record[5] == 0x10 * (records + 1) && !record[6] && !record[7]);
+    records++;
+    record += 16;
+  }
+  printf("journal records: %u\n", records);
+  assert(records == 4);
+  assert(sim.violations() == 0);
+  puts("OK");
+  return 0;
+}